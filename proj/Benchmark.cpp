@@ -0,0 +1,207 @@
+#include "SphereSystem.h"
+#include "RigidBody.h"
+#include "GlobalVariables.h"
+#include <omp.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace glm;
+
+// Total energy of the spheres of a system
+static double totalEnergy(const SphereSystem& system) {
+    double E = 0.0;
+    for (int i = 0; i < system.size(); i++) E += system.energy(i);
+    return E;
+}
+
+/**
+ * Drop a cloud of spinning spheres in free flight and advance it with each
+ * integrator, printing the cost per step and the relative drift of the total
+ * energy
+ */
+static void benchmarkIntegrators() {
+    const int count = 4096;
+    const float duration = 2.0f;
+    const float steps[] = { 0.004f, 0.016f };
+
+    std::cout << "\n---- Integrator benchmark: " << count << " spheres, "
+        << duration << " s of free flight ----" << std::endl;
+    for (int s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        float h = steps[s];
+        int n = (int)(duration / h);
+        for (int integrator = 0; integrator < INTEGRATORS; integrator++) {
+            // The same spheres for every integrator
+            // Only the kernel is timed: no swept tests, every sphere at full rate
+            SphereSystem system;
+            system.setIntegrator((Integrator)integrator);
+            system.ccd = false;
+            system.rateTiers = 1;
+            srand(11);
+            for (int i = 0; i < count; i++) {
+                vec3 pos(rand() / (float)RAND_MAX, 20.0f + rand() / (float)RAND_MAX, rand() / (float)RAND_MAX);
+                vec3 vel(rand() / (float)RAND_MAX - 0.5f, 5.0f * rand() / (float)RAND_MAX, rand() / (float)RAND_MAX - 0.5f);
+                system.add(pos, vel, 0.02f, 0.3f);
+                for (int k = 0; k < 3; k++) system.L[k][i] = 1e-5f * (rand() / (float)RAND_MAX - 0.5f);
+            }
+            system.release(-1.0f);
+
+            // only the integration is timed, the energy is measured between the steps
+            double E0 = totalEnergy(system), maxDrift = 0.0, elapsed = 0.0;
+            for (int k = 0; k < n; k++) {
+                double start = omp_get_wtime();
+                system.integrate(k * h, h);
+                elapsed += omp_get_wtime() - start;
+                double drift = std::abs(totalEnergy(system) - E0) / E0;
+                if (drift > maxDrift) maxDrift = drift;
+            }
+
+            std::cout << "h = " << h << " " << integratorName((Integrator)integrator)
+                << " (" << sphereKernelName(system.kernel) << "): "
+                << 1e6 * elapsed / n << " us/step, max energy drift " << maxDrift << std::endl;
+        }
+    }
+}
+
+// A spinning ball thrown above a penalty floor, in free flight most of the time
+static void createBouncingBody(RigidBody& body) {
+    const float r = 0.03f, stiffness = 3e4f;
+    body.m = 0.3f;
+    body.setInertia(2.0f / 5 * body.m * r * r);
+    body.x = vec3(0.0f, 2.0f, 0.0f);
+    body.P = body.m * vec3(1.0f, 3.0f, 0.0f);
+    body.L = vec3(0.0f, 0.0f, 1e-4f);
+    body.setY(body.getY());
+    body.forcing = [&body, r, stiffness](float t, const RigidBody::State& y)->std::vector<float> {
+        std::vector<float> f(6, 0.0f);
+        f[1] = -body.m * g_earth;
+        if (y[1] < r) f[1] += stiffness * (r - y[1]);
+        return f;
+    };
+}
+
+/**
+ * Bounce a rigid body on a stiff penalty floor with fixed RK4 steps and with
+ * adaptive Dormand-Prince steps at several tolerances, printing the steps,
+ * the rejected steps and the error against a fine reference solution
+ */
+static void benchmarkAdaptive() {
+    const float duration = 5.0f;
+    const float frame = 1.0f / 60;
+    const int frames = (int)(duration / frame);
+    const float tolerances[] = { 1e-3f, 1e-4f, 1e-5f, 1e-6f };
+
+    std::cout << "\n---- Adaptive integrator benchmark: " << duration
+        << " s of a body bouncing on a stiff floor ----" << std::endl;
+
+    // Reference with tiny fixed steps
+    RigidBody reference;
+    createBouncingBody(reference);
+    const int substeps = 200;
+    for (int n = 0; n < frames * substeps; n++)
+        reference.advanceState(n * frame / substeps, frame / substeps);
+
+    // The fixed step that used to be the clamp in mainLoop
+    RigidBody fixed;
+    createBouncingBody(fixed);
+    const float h = 0.004f;
+    int steps = (int)(duration / h);
+    for (int n = 0; n < steps; n++) fixed.advanceState(n * h, h);
+    std::cout << "RK4 h = " << h << ": " << steps << " steps, " << 4 * steps
+        << " derivatives, position error " << distance(fixed.x, reference.x) << std::endl;
+
+    for (int k = 0; k < sizeof(tolerances) / sizeof(tolerances[0]); k++) {
+        RigidBody body;
+        createBouncingBody(body);
+        for (int n = 0; n < frames; n++)
+            body.advanceStateAdaptive(n * frame, frame, tolerances[k]);
+        std::cout << "DP45 tolerance " << tolerances[k] << ": " << body.acceptedSteps << " steps, "
+            << body.rejectedSteps << " rejected, " << 7 * (body.acceptedSteps + body.rejectedSteps)
+            << " derivatives, position error " << distance(body.x, reference.x) << std::endl;
+    }
+}
+
+/**
+ * Drop a pile of spheres on the floor with the impulse and the XPBD contact
+ * solvers at several steps, printing the cost per step and how much the
+ * settled pile still jitters (mean speed) and sinks (deepest overlap)
+ */
+static void benchmarkSolvers() {
+    const int side = 12, layers = 16;
+    const float radius = 0.02f, duration = 3.0f;
+    const float steps[] = { 0.004f, 0.016f };
+    const ContactSolver solvers[] = { IMPULSE_SOLVER, XPBD_SOLVER };
+    const char* names[] = { "impulse", "XPBD" };
+
+    std::cout << "\n---- Contact solver benchmark: pile of " << side * side * layers
+        << " spheres, " << duration << " s ----" << std::endl;
+    for (int s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        float h = steps[s];
+        int n = (int)(duration / h);
+        for (int k = 0; k < 2; k++) {
+            // A loose column of spheres, never put to sleep so that the solvers do all the work
+            SphereSystem system;
+            system.solver = solvers[k];
+            system.sleepFrames = 1 << 30;
+            srand(5);
+            for (int l = 0; l < layers; l++)
+                for (int a = 0; a < side; a++)
+                    for (int b = 0; b < side; b++) {
+                        vec3 jitter(rand() / (float)RAND_MAX, 0.0f, rand() / (float)RAND_MAX);
+                        vec3 pos = vec3(a, 2 * l + 1, b) * 2.2f * radius + 0.1f * radius * jitter;
+                        system.add(pos, vec3(0.0f), radius, 0.3f);
+                    }
+            system.release(-1.0f);
+
+            double elapsed = 0.0;
+            float speed = 0.0f;
+            int samples = 0;
+            for (int step = 0; step < n; step++) {
+                double start = omp_get_wtime();
+                system.beginStep();
+                system.collide();
+                system.integrate(step * h, h);
+                system.updateSleeping();
+                elapsed += omp_get_wtime() - start;
+                // the last second, when the pile should be at rest
+                if (step * h < duration - 1.0f) continue;
+                for (int i = 0; i < system.size(); i++) speed += length(system.velocity(i));
+                samples += system.size();
+            }
+
+            float overlap = 0.0f;
+            for (int p = 0; p < system.broadphase.pairs.size(); p++) {
+                int i = system.broadphase.pairs[p].first, j = system.broadphase.pairs[p].second;
+                overlap = std::max(overlap, system.r[i] + system.r[j] - distance(system.position(i), system.position(j)));
+            }
+            for (int i = 0; i < system.size(); i++)
+                overlap = std::max(overlap, system.r[i] - system.x[1][i]);
+
+            std::cout << "h = " << h << " " << names[k] << ": " << 1e3 * elapsed / n << " ms/step, mean speed at rest "
+                << speed / samples << " m/s, deepest overlap " << overlap / radius << " radii" << std::endl;
+        }
+    }
+}
+
+/**
+ * Physics benchmarks, kept out of the game: runs the integrator, the
+ * adaptive integrator and the contact solver benchmarks, or only the one
+ * named on the command line.
+ *
+ * usage: thanos_benchmark [integrators|adaptive|solvers]
+ */
+int main(int argc, char* argv[]) {
+    const char* only = argc > 1 ? argv[1] : NULL;
+    if (only && strcmp(only, "integrators") && strcmp(only, "adaptive") && strcmp(only, "solvers")) {
+        std::cerr << "usage: thanos_benchmark [integrators|adaptive|solvers]" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Available threads: " << omp_get_max_threads() << std::endl;
+    std::cout << "Sphere integration kernel: " << sphereKernelName(selectSphereKernel()) << std::endl;
+    if (!only || !strcmp(only, "integrators")) benchmarkIntegrators();
+    if (!only || !strcmp(only, "adaptive")) benchmarkAdaptive();
+    if (!only || !strcmp(only, "solvers")) benchmarkSolvers();
+    return 0;
+}
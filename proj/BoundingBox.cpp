@@ -138,19 +138,3 @@ void BoundingBox::draw(unsigned int drawable) {
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     glEnable(GL_CULL_FACE);
 }
-
-// Initialize the bounding box vertices array with the vertices of the model
-// that are inside the box
-void BoundingBox::fillVertices(std::vector<glm::vec3> modelVertices) {
-    for (int i = 0; i < modelVertices.size(); i += 3) {
-        bool add = false;
-        if (modelVertices[i].y > limits[2] && modelVertices[i].y < limits[3]) add = add || true;
-        if (modelVertices[i+1].y > limits[2] && modelVertices[i+1].y < limits[3]) add = add || true;
-        if (modelVertices[i+2].y > limits[2] && modelVertices[i+2].y < limits[3]) add = add || true;
-        if (add) {
-            vertices.push_back(modelVertices[i]);
-            vertices.push_back(modelVertices[i+1]);
-            vertices.push_back(modelVertices[i+2]);
-        }
-    }
-}
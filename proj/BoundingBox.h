@@ -20,7 +20,6 @@ public:
     ~BoundingBox();
 
     void draw(unsigned int drawable = 0);
-    void BoundingBox::fillVertices(std::vector<glm::vec3> modelVertices);
 };
 
 #endif
@@ -0,0 +1,98 @@
+#include "Broadphase.h"
+#include "SphereSystem.h"
+#include <cmath>
+
+// Hash of the integer cell coordinates into a power of two table
+static inline unsigned int cellHash(int ix, int iy, int iz, unsigned int mask) {
+    return ((unsigned int)ix * 73856093u ^ (unsigned int)iy * 19349663u ^ (unsigned int)iz * 83492791u) & mask;
+}
+
+void Broadphase::findPairs(const SphereSystem& spheres, float cellSize) {
+    pairs.clear();
+    active.clear();
+    entries.clear();
+    for (int i = 0; i < spheres.size(); i++) {
+        if (spheres.released[i]) active.push_back(i);
+    }
+    if (active.size() < 2) return;
+
+    // Table with at least twice as many buckets as spheres
+    unsigned int tableSize = 1;
+    while (tableSize < 2 * active.size()) tableSize <<= 1;
+    mask = tableSize - 1;
+
+    // Counting sort of the spheres by bucket, stable in index order
+    inv = 1.0f / cellSize;
+    cells.resize(3 * spheres.size());
+    bucketStart.assign(tableSize + 1, 0);
+    for (int a = 0; a < active.size(); a++) {
+        int i = active[a];
+        for (int k = 0; k < 3; k++)
+            cells[3 * i + k] = (int)std::floor(spheres.x[k][i] * inv);
+        bucketStart[cellHash(cells[3 * i], cells[3 * i + 1], cells[3 * i + 2], mask) + 1]++;
+    }
+    for (unsigned int b = 0; b < tableSize; b++)
+        bucketStart[b + 1] += bucketStart[b];
+    entries.resize(active.size());
+    std::vector<int> next(bucketStart.begin(), bucketStart.end() - 1);
+    for (int a = 0; a < active.size(); a++) {
+        int i = active[a];
+        entries[next[cellHash(cells[3 * i], cells[3 * i + 1], cells[3 * i + 2], mask)]++] = i;
+    }
+
+    // Pair every sphere with the higher index spheres of the 27 cells around it.
+    // Checking the cell of j skips hash collisions, so no pair is reported twice.
+    for (int a = 0; a < active.size(); a++) {
+        int i = active[a];
+        for (int dz = -1; dz <= 1; dz++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int cx = cells[3 * i] + dx, cy = cells[3 * i + 1] + dy, cz = cells[3 * i + 2] + dz;
+                    unsigned int b = cellHash(cx, cy, cz, mask);
+                    for (int e = bucketStart[b]; e < bucketStart[b + 1]; e++) {
+                        int j = entries[e];
+                        if (j <= i) continue;
+                        if (cells[3 * j] != cx || cells[3 * j + 1] != cy || cells[3 * j + 2] != cz) continue;
+                        pairs.push_back(std::make_pair(i, j));
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Broadphase::query(const glm::vec3& lo, const glm::vec3& hi, std::vector<int>& found) const {
+    found.clear();
+    if (entries.empty()) return;
+    int c0[3], c1[3];
+    float cellCount = 1.0f;
+    for (int k = 0; k < 3; k++) {
+        c0[k] = (int)std::floor(lo[k] * inv);
+        c1[k] = (int)std::floor(hi[k] * inv);
+        cellCount *= c1[k] - c0[k] + 1;
+    }
+
+    // A box larger than the number of spheres is cheaper to check sphere by sphere
+    if (cellCount > active.size()) {
+        for (int a = 0; a < active.size(); a++) {
+            int i = active[a];
+            bool inside = true;
+            for (int k = 0; k < 3 && inside; k++)
+                inside = cells[3 * i + k] >= c0[k] && cells[3 * i + k] <= c1[k];
+            if (inside) found.push_back(i);
+        }
+        return;
+    }
+    for (int cz = c0[2]; cz <= c1[2]; cz++) {
+        for (int cy = c0[1]; cy <= c1[1]; cy++) {
+            for (int cx = c0[0]; cx <= c1[0]; cx++) {
+                unsigned int b = cellHash(cx, cy, cz, mask);
+                for (int e = bucketStart[b]; e < bucketStart[b + 1]; e++) {
+                    int j = entries[e];
+                    if (cells[3 * j] == cx && cells[3 * j + 1] == cy && cells[3 * j + 2] == cz)
+                        found.push_back(j);
+                }
+            }
+        }
+    }
+}
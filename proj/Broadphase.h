@@ -0,0 +1,43 @@
+#ifndef BROADPHASE_H
+#define BROADPHASE_H
+
+#include <vector>
+#include <utility>
+#include <glm/glm.hpp>
+
+class SphereSystem;
+
+/**
+ * Uniform spatial hash grid for sphere to sphere collisions. Every released
+ * sphere (awake or sleeping) is bucketed by the grid cell of its center and only spheres in
+ * the same or in neighbouring cells become candidate pairs. With a cell
+ * size of at least twice the largest radius no overlapping pair is missed.
+ */
+class Broadphase {
+public:
+    /** unique candidate pairs (i < j) found by the last findPairs */
+    std::vector<std::pair<int, int>> pairs;
+
+    /** Bucket the released spheres into cells of side cellSize and fill pairs */
+    void findPairs(const SphereSystem& spheres, float cellSize);
+    /**
+     * Spheres bucketed by the last findPairs whose center lies in a cell
+     * overlapping the box [lo, hi]. The box must include the radii.
+     */
+    void query(const glm::vec3& lo, const glm::vec3& hi, std::vector<int>& found) const;
+
+private:
+    /** 1 / cell size and table size - 1 of the last findPairs */
+    float inv;
+    unsigned int mask;
+    /** cell coordinates of every bucketed sphere, 3 per sphere */
+    std::vector<int> cells;
+    /** bucketed spheres sorted by hash bucket */
+    std::vector<int> entries;
+    /** first entry of every bucket, plus one past the end */
+    std::vector<int> bucketStart;
+    /** released spheres, in index order */
+    std::vector<int> active;
+};
+
+#endif
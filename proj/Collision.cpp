@@ -1,34 +1,96 @@
 #include "Collision.h"
 #include "Box.h"
-#include "Sphere.h"
+#include "SphereSystem.h"
+#include "MeshBVH.h"
 
 using namespace glm;
 
 // Function declarations
-void handleSpheresCollision(Sphere& sphere1, Sphere& sphere2);
 bool checkForSpheresCollision(glm::vec3& pos1, const float& r1, glm::vec3& pos2, const float& r2, glm::vec3& n);
 bool checkForFloorSphereCollision(vec3& pos, const float& r, vec3& n);
 
-// Check and handle sphere to sphere collisions
-void handleSpheresCollision(Sphere& sphere1, Sphere& sphere2) {
+// Check and handle the collision of spheres i and j of a sphere system
+bool handleSpheresCollision(SphereSystem& spheres, int i, int j) {
+    // two sleeping spheres are at rest against each other
+    if (!spheres.awake[i] && !spheres.awake[j]) return false;
     vec3 n;
-    if (checkForSpheresCollision(sphere1.x, sphere1.r, sphere2.x, sphere2.r, n)) {
+    vec3 pos1 = spheres.position(i);
+    vec3 pos2 = spheres.position(j);
+    if (checkForSpheresCollision(pos1, spheres.r[i], pos2, spheres.r[j], n)) {
+        vec3 v1 = spheres.velocity(i);
+        vec3 v2 = spheres.velocity(j);
         vec3 vel1x, vel1y, vel2x, vel2y;
         //sphere 1
-        vel1x = n * glm::dot(n, sphere1.v);
-        vel1y = sphere1.v - vel1x;
+        vel1x = n * glm::dot(n, v1);
+        vel1y = v1 - vel1x;
         //sphere 2
         n = -n;
-        vel2x = n * glm::dot(n, sphere2.v);
-        vel2y = sphere2.v - vel2x;
-
-        float m1 = sphere1.m;
-        float m2 = sphere2.m;
-        sphere1.v = vel1x * (m1 - m2) / (m1 + m2) + vel2x * (2.f * m2) / (m1 + m2) + vel1y;
-        sphere2.v = vel1x * (2.f * m1) / (m1 + m2) + vel2x * (m2 - m1) / (m1 + m2) + vel2y;
-        sphere1.P = (m1 * sphere1.v) * 0.9f;
-        sphere2.P = (m2 * sphere2.v) * 0.9f;
+        vel2x = n * glm::dot(n, v2);
+        vel2y = v2 - vel2x;
+
+        float m1 = spheres.m[i];
+        float m2 = spheres.m[j];
+        v1 = vel1x * (m1 - m2) / (m1 + m2) + vel2x * (2.f * m2) / (m1 + m2) + vel1y;
+        v2 = vel1x * (2.f * m1) / (m1 + m2) + vel2x * (m2 - m1) / (m1 + m2) + vel2y;
+        spheres.setPosition(i, pos1);
+        spheres.setPosition(j, pos2);
+        spheres.setMomentum(i, (m1 * v1) * 0.9f);
+        spheres.setMomentum(j, (m2 * v2) * 0.9f);
+        // hitting a sleeping sphere wakes it up
+        if (!spheres.awake[i]) spheres.wake(i);
+        if (!spheres.awake[j]) spheres.wake(j);
+        return true;
+    }
+    return false;
+}
+
+// Split the candidate pairs into batches where no sphere appears twice
+void ContactBatches::build(const std::vector<std::pair<int, int>>& candidates, int sphereCount) {
+    // 64 colors fit in the bit masks, pairs that find no free color go to
+    // a last batch that is resolved serially
+    const int MAX_COLORS = 64;
+    used.assign(sphereCount, 0);
+    color.resize(candidates.size());
+    batchStart.assign(MAX_COLORS + 2, 0);
+    for (int p = 0; p < candidates.size(); p++) {
+        int i = candidates[p].first, j = candidates[p].second;
+        unsigned long long taken = used[i] | used[j];
+        int c = 0;
+        while (c < MAX_COLORS && (taken >> c) & 1ull) c++;
+        if (c < MAX_COLORS) {
+            used[i] |= 1ull << c;
+            used[j] |= 1ull << c;
+        }
+        color[p] = c;
+        batchStart[c + 1]++;
     }
+
+    // Counting sort by color, keeping the candidate order inside a batch
+    for (int c = 0; c <= MAX_COLORS; c++)
+        batchStart[c + 1] += batchStart[c];
+    std::vector<int> next(batchStart.begin(), batchStart.end() - 1);
+    pairs.resize(candidates.size());
+    for (int p = 0; p < candidates.size(); p++)
+        pairs[next[color[p]]++] = candidates[p];
+}
+
+// Narrowphase: check and handle the candidate pairs found by the broadphase.
+// Batches are resolved one after the other, the pairs of a batch in parallel.
+int handleSpheresCollisions(SphereSystem& spheres, const std::vector<std::pair<int, int>>& pairs,
+                            ContactBatches& batches) {
+    batches.build(pairs, spheres.size());
+    int colors = (int)batches.batchStart.size() - 2;
+    int contacts = 0;
+    for (int c = 0; c < colors; c++) {
+        int begin = batches.batchStart[c], end = batches.batchStart[c + 1];
+        #pragma omp parallel for reduction(+:contacts) if(end - begin > 256)
+        for (int p = begin; p < end; p++)
+            contacts += handleSpheresCollision(spheres, batches.pairs[p].first, batches.pairs[p].second);
+    }
+    // overflow batch
+    for (int p = batches.batchStart[colors]; p < batches.batchStart[colors + 1]; p++)
+        contacts += handleSpheresCollision(spheres, batches.pairs[p].first, batches.pairs[p].second);
+    return contacts;
 }
 
 // Check if two spheres collided
@@ -49,13 +111,36 @@ bool checkForSpheresCollision(vec3& pos1, const float& r1, vec3& pos2, const flo
         return false;
 }
 
-// Check and handle sphere to floor collisions
-void handleFloorSphereCollision(Sphere& sphere) {
+// Check and handle the floor collision of sphere i of a sphere system
+bool handleFloorSphereCollision(SphereSystem& spheres, int i) {
     vec3 n;
-    if (checkForFloorSphereCollision(sphere.x, sphere.r, n)) {
-        sphere.v = sphere.v - n * glm::dot(sphere.v, n) * 2.0f;
-        sphere.P = (sphere.m * sphere.v) * 0.9f;
+    vec3 pos = spheres.position(i);
+    if (checkForFloorSphereCollision(pos, spheres.r[i], n)) {
+        vec3 v = spheres.velocity(i);
+        v = v - n * glm::dot(v, n) * 2.0f;
+        spheres.setPosition(i, pos);
+        spheres.setMomentum(i, (spheres.m[i] * v) * 0.9f);
+        return true;
     }
+    return false;
+}
+
+// Check and handle the collision of sphere i of a sphere system with the undissolved body
+bool handleBodySphereCollision(SphereSystem& spheres, int i, const MeshBVH& body,
+                               const vec3& offset, float level) {
+    vec3 n;
+    float depth;
+    if (body.collideSphere(spheres.position(i) - offset, spheres.r[i], level, n, depth)) {
+        // push out of the surface and reflect the velocity if moving into it
+        vec3 v = spheres.velocity(i);
+        spheres.setPosition(i, spheres.position(i) + n * depth);
+        if (dot(v, n) < 0.0f) {
+            v = v - n * glm::dot(v, n) * 2.0f;
+            spheres.setMomentum(i, (spheres.m[i] * v) * 0.9f);
+        }
+        return true;
+    }
+    return false;
 }
 
 // Check for floor collision
@@ -72,3 +157,20 @@ bool checkForFloorSphereCollision(vec3& pos, const float& r, vec3& n) {
         return false;
 }
 
+
+float sweepFloorSphere(const vec3& a, const vec3& b, float r) {
+    if (a.y - r <= 0 || b.y - r > 0) return 2.0f;
+    return (a.y - r) / (a.y - b.y);
+}
+
+float sweepSpheres(const vec3& a1, const vec3& b1, float r1, const vec3& a2, const vec3& b2, float r2) {
+    // |d0 + t dd| = r1 + r2, with the distance d0 at the start and its change dd
+    vec3 d0 = a1 - a2;
+    vec3 dd = (b1 - a1) - (b2 - a2);
+    float R = r1 + r2;
+    float a = dot(dd, dd), b = 2.0f * dot(d0, dd), c = dot(d0, d0) - R * R;
+    if (c <= 0 || b >= 0) return 2.0f;
+    float disc = b * b - 4.0f * a * c;
+    if (disc < 0) return 2.0f;
+    return (-b - sqrt(disc)) / (2.0f * a);
+}
@@ -2,9 +2,46 @@
 #define COLLISION_H
 
 #include <glm/glm.hpp>
+#include <vector>
+#include <utility>
 
 class Box;
-class Sphere;
-void handleFloorSphereCollision(Sphere& sphere);
-void handleSpheresCollision(Sphere& sphere1, Sphere& sphere2);
+class SphereSystem;
+class MeshBVH;
+
+/**
+ * Contact pairs split into batches that share no sphere, by greedy coloring
+ * of the contact graph. The pairs of one batch can be resolved in parallel
+ * and the result does not depend on the number of threads.
+ */
+struct ContactBatches {
+    /** the pairs, ordered by batch */
+    std::vector<std::pair<int, int>> pairs;
+    /** first pair of every batch, plus one past the end */
+    std::vector<int> batchStart;
+    /** colors already taken by the pairs of every sphere, one bit per color */
+    std::vector<unsigned long long> used;
+    std::vector<int> color;
+
+    void build(const std::vector<std::pair<int, int>>& candidates, int sphereCount);
+};
+
+/**
+ * Time of impact in [0, 1] of a sphere of radius r moving linearly from a
+ * to b with the floor, or of two spheres moving linearly from a1 to b1 and
+ * from a2 to b2. Returns a value above 1 if they do not touch during the
+ * motion or if they already overlap at its start.
+ */
+float sweepFloorSphere(const glm::vec3& a, const glm::vec3& b, float r);
+float sweepSpheres(const glm::vec3& a1, const glm::vec3& b1, float r1,
+                   const glm::vec3& a2, const glm::vec3& b2, float r2);
+/** Floor and sphere to sphere collisions of a sphere system, return whether there was a contact */
+bool handleFloorSphereCollision(SphereSystem& spheres, int i);
+bool handleSpheresCollision(SphereSystem& spheres, int i, int j);
+/** Collision of sphere i with the surface of a mesh placed at offset, below level (model space) */
+bool handleBodySphereCollision(SphereSystem& spheres, int i, const MeshBVH& body,
+                               const glm::vec3& offset, float level);
+/** Resolve the candidate pairs, returns the number of them that were in contact */
+int handleSpheresCollisions(SphereSystem& spheres, const std::vector<std::pair<int, int>>& pairs,
+                            ContactBatches& batches);
 #endif
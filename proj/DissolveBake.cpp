@@ -0,0 +1,190 @@
+#include "SphereSystem.h"
+#include "DissolveBake.h"
+#include <glm/gtc/quaternion.hpp>
+#include <cmath>
+
+using namespace glm;
+
+const float DissolveRecording::POSITION_STEP = 0.0005f;
+const float DissolveRecording::ROTATION_SCALE = 32767.0f;
+
+// Zigzag (small magnitudes of either sign give small codes) varint encoding
+static void writeVarint(std::vector<unsigned char>& data, int v) {
+    unsigned int u = ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+    while (u >= 0x80) {
+        data.push_back((unsigned char)(u | 0x80));
+        u >>= 7;
+    }
+    data.push_back((unsigned char)u);
+}
+
+static int readVarint(const std::vector<unsigned char>& data, size_t& pos) {
+    unsigned int u = 0;
+    int shift = 0;
+    unsigned char b;
+    do {
+        b = data[pos++];
+        u |= (unsigned int)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+DissolveRecording::DissolveRecording() {
+    frameTime = 0.0f;
+    keyInterval = 30;
+    handles = 0;
+    complete = false;
+}
+
+void DissolveRecording::begin(const SphereSystem& spheres, const vec3& origin, float frameTime, int keyInterval) {
+    this->origin = origin;
+    this->frameTime = frameTime;
+    this->keyInterval = keyInterval;
+    handles = (int)spheres.handleIndex.size();
+    radius.assign(handles, 0.0f);
+    for (int i = 0; i < spheres.size(); i++)
+        radius[spheres.sphereHandle[i]] = spheres.r[i];
+    data.clear();
+    frameStart.clear();
+    last.assign(VALUES * handles, 0);
+    shown.assign(handles, 0);
+    complete = false;
+}
+
+void DissolveRecording::record(const SphereSystem& spheres) {
+    bool key = frames() % keyInterval == 0;
+    frameStart.push_back(data.size());
+    data.push_back(key ? 1 : 0);
+
+    // Shown spheres bitmask, then the values
+    shown.assign(handles, 0);
+    std::vector<int> current(last);
+    for (int i = 0; i < spheres.size(); i++) {
+        int h = spheres.sphereHandle[i];
+        int* v = &current[VALUES * h];
+        vec3 p = (spheres.position(i) - origin) / POSITION_STEP;
+        for (int k = 0; k < 3; k++) v[k] = (int)std::floor(p[k] + 0.5f);
+        for (int k = 0; k < 4; k++) v[3 + k] = (int)std::floor(spheres.q[k][i] * ROTATION_SCALE + 0.5f);
+        shown[h] = spheres.released[i];
+    }
+    for (int h = 0; h < handles; h += 8) {
+        unsigned char bits = 0;
+        for (int b = 0; b < 8 && h + b < handles; b++) bits |= shown[h + b] << b;
+        data.push_back(bits);
+    }
+    for (int h = 0; h < handles; h++) {
+        if (!key && !shown[h]) continue;
+        for (int k = 0; k < VALUES; k++) {
+            int v = current[VALUES * h + k];
+            writeVarint(data, key ? v : v - last[VALUES * h + k]);
+            last[VALUES * h + k] = v;
+        }
+    }
+}
+
+void DissolveRecording::finish() {
+    complete = true;
+    std::vector<int>().swap(last);
+    std::vector<unsigned char>().swap(shown);
+}
+
+DissolvePlayback::DissolvePlayback() {
+    recording = NULL;
+    active = false;
+    time = 0.0;
+    frame = 0;
+    next = 0;
+}
+
+void DissolvePlayback::start(const DissolveRecording* recording) {
+    this->recording = recording;
+    active = recording->frames() >= 2;
+    time = 0.0;
+    frame = -2;
+    next = 0;
+    for (int s = 0; s < 2; s++) {
+        values[s].assign(DissolveRecording::VALUES * recording->handles, 0);
+        shown[s].assign(recording->handles, 0);
+    }
+    // decode frames 0 and 1
+    if (active) active = decode() && decode();
+}
+
+bool DissolvePlayback::decode() {
+    if (frame + 2 >= recording->frames()) return false;
+    const int VALUES = DissolveRecording::VALUES;
+    const std::vector<unsigned char>& data = recording->data;
+    int handles = recording->handles;
+    values[0].swap(values[1]);
+    shown[0].swap(shown[1]);
+    // deltas are relative to the previous frame, now in slot 0
+    values[1] = values[0];
+    frame++;
+
+    size_t pos = next;
+    bool key = data[pos++] != 0;
+    for (int h = 0; h < handles; h++)
+        shown[1][h] = (data[pos + h / 8] >> (h % 8)) & 1;
+    pos += (handles + 7) / 8;
+    for (int h = 0; h < handles; h++) {
+        if (!key && !shown[1][h]) continue;
+        for (int k = 0; k < VALUES; k++) {
+            int v = readVarint(data, pos);
+            values[1][VALUES * h + k] = key ? v : values[1][VALUES * h + k] + v;
+        }
+    }
+    next = pos;
+    return true;
+}
+
+void DissolvePlayback::advance(float dt) {
+    if (!active) return;
+    time += dt;
+    // the margin absorbs the rounding of frameTime against the steps that make it up
+    while (time >= (frame + 1 - 1e-3) * recording->frameTime) {
+        if (!decode()) {
+            active = false;
+            return;
+        }
+    }
+}
+
+void DissolvePlayback::writeInstanceMatrices(const vec3& origin, float ahead, const mat4& viewProjection,
+                                             std::vector<mat4>& matrices) const {
+    matrices.clear();
+    if (!active) return;
+    const int VALUES = DissolveRecording::VALUES;
+    const float ps = DissolveRecording::POSITION_STEP, rs = 1.0f / DissolveRecording::ROTATION_SCALE;
+    float alpha = (float)((time + ahead) / recording->frameTime - frame);
+    alpha = clamp(alpha, 0.0f, 1.0f);
+    vec4 planes[6];
+    SphereSystem::frustumPlanes(viewProjection, planes);
+
+    for (int h = 0; h < recording->handles; h++) {
+        // a sphere removed in the next frame stays where it was
+        if (!shown[0][h]) continue;
+        float a = shown[1][h] ? alpha : 0.0f;
+        const int* v0 = &values[0][VALUES * h];
+        const int* v1 = &values[1][VALUES * h];
+        vec3 x = origin + ps * mix(vec3(v0[0], v0[1], v0[2]), vec3(v1[0], v1[1], v1[2]), a);
+        float r = recording->radius[h];
+        bool inside = true;
+        for (int k = 0; k < 6 && inside; k++)
+            inside = dot(vec3(planes[k]), x) + planes[k].w >= -r;
+        if (!inside) continue;
+
+        quat q0(v0[6] * rs, v0[3] * rs, v0[4] * rs, v0[5] * rs);
+        quat q1(v1[6] * rs, v1[3] * rs, v1[4] * rs, v1[5] * rs);
+        if (dot(q0, q1) < 0.0f) q1 = -q1;
+        quat q = normalize(q0 * (1.0f - a) + q1 * a);
+
+        // translation * rotation * scale, as SphereSystem::writeInstanceMatrices
+        mat4 M = mat4_cast(q);
+        M[0] *= r;
+        M[1] *= r;
+        M[2] *= r;
+        M[3] = vec4(x, 1.0f);
+        matrices.push_back(M);
+    }
+}
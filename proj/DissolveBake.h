@@ -0,0 +1,90 @@
+#ifndef DISSOLVE_BAKE_H
+#define DISSOLVE_BAKE_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+class SphereSystem;
+
+/**
+ * Compressed recording of the sphere trajectories of one dissolve. Every
+ * frame stores which spheres are shown (released and not removed) and their
+ * quantized position (relative to the model) and orientation. Keyframes hold
+ * absolute values of every sphere, the frames in between only the zigzag
+ * varint deltas of the shown spheres from their last values.
+ */
+class DissolveRecording {
+public:
+    /** position quantization step (meters) and orientation scale */
+    static const float POSITION_STEP;
+    static const float ROTATION_SCALE;
+    /** values per sphere: 3 position, 4 orientation (x, y, z, w) */
+    static const int VALUES = 7;
+
+    /** seconds between two frames, a keyframe every keyInterval frames */
+    float frameTime;
+    int keyInterval;
+    /** spheres recorded (by handle) and their radii */
+    int handles;
+    std::vector<float> radius;
+    /** encoded frames and where each one starts */
+    std::vector<unsigned char> data;
+    std::vector<size_t> frameStart;
+    /** the dissolve was recorded to its end, it can be played back */
+    bool complete;
+
+    DissolveRecording();
+    /** Start recording the spheres of a system placed at origin, a frame every frameTime seconds */
+    void begin(const SphereSystem& spheres, const glm::vec3& origin, float frameTime, int keyInterval = 30);
+    /** Append the current state of the spheres as the next frame */
+    void record(const SphereSystem& spheres);
+    /** Mark the recording as complete and release the encoder state */
+    void finish();
+    int frames() const { return (int)frameStart.size(); }
+
+private:
+    glm::vec3 origin;
+    /** last encoded values of every sphere */
+    std::vector<int> last;
+    std::vector<unsigned char> shown;
+};
+
+/**
+ * Streaming decoder of a recording, for one model instance. It keeps two
+ * consecutive decoded frames and interpolates between them.
+ */
+class DissolvePlayback {
+public:
+    const DissolveRecording* recording;
+    /**
+     * the playback is running, and the time into the recording (a double, the
+     * sum of thousands of float steps drifts by more than a frame)
+     */
+    bool active;
+    double time;
+
+    DissolvePlayback();
+    /** Play a complete recording from its start */
+    void start(const DissolveRecording* recording);
+    /** Advance the playback time, decoding the frames passed. Stops at the end. */
+    void advance(float dt);
+    /**
+     * Model matrices of the shown spheres at time + ahead, placed at origin
+     * and interpolated between the two decoded frames. Only the spheres that
+     * intersect the view frustum of viewProjection are written, as in
+     * SphereSystem::cull.
+     */
+    void writeInstanceMatrices(const glm::vec3& origin, float ahead, const glm::mat4& viewProjection,
+                               std::vector<glm::mat4>& matrices) const;
+
+private:
+    /** index of the first of the two decoded frames, and the read position of the next one */
+    int frame;
+    size_t next;
+    std::vector<int> values[2];
+    std::vector<unsigned char> shown[2];
+    /** Decode the next frame into slot 1, moving slot 1 to slot 0 */
+    bool decode();
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include "EffectCache.h"
+#include "SphereFit.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace glm;
+
+// Cache layout version, bump it when the layout or the fitting changes
+static const unsigned int CACHE_VERSION = 4;
+static const char CACHE_MAGIC[4] = { 'T', 'S', 'F', 'C' };
+
+FitParameters::FitParameters() {
+    cubeSide = 15;
+    rad[0] = 0.03f;
+    rad[1] = 0.02f;
+    rad[2] = 0.015f;
+    bboardSize = 0.02f;
+    voxelSize = 0.005f;
+    sdfBand = 0.035f;
+    adaptive = false;
+    minRadius = 0.015f;
+    maxRadius = 0.1f;
+    sphereBudget = 0;
+}
+
+unsigned long long hashMesh(const std::vector<vec3>& vertices) {
+    unsigned long long h = 14695981039346656037ull;
+    const unsigned char* bytes = (const unsigned char*)vertices.data();
+    size_t size = vertices.size() * sizeof(vec3);
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+void bakeFitData(const std::vector<vec3>& vertices, const FitParameters& params, FitData& data) {
+    createLimitsArray(vertices);
+    memcpy(data.limits, limits, sizeof(limits));
+    for (int i = 0; i < 5; i++)
+        sliceTriangles(vertices, limits[i][2], limits[i][3], data.slabVertices[i]);
+
+    createVoxelGrid(params.voxelSize);
+    // the octree packing reads depths up to its largest radius from the field
+    createDistanceField(params.adaptive ? std::max(params.sdfBand, params.maxRadius) : params.sdfBand);
+    data.voxels = bodyVoxels;
+    data.field = bodySDF;
+
+    billboardMap.assign(5, std::vector<bool>());
+    b_levels.clear();
+    createBillboardMap(params.bboardSize);
+    data.billboardMap = billboardMap;
+    data.levels = b_levels;
+
+    data.spheres.clear();
+    if (params.adaptive) packSpheres(params.minRadius, params.maxRadius, params.sphereBudget, data.spheres);
+    else createSpheres(params.cubeSide, params.rad, data.spheres);
+}
+
+// Appends plain values to a byte buffer
+static void put(std::vector<unsigned char>& out, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+static void putCount(std::vector<unsigned char>& out, size_t count) {
+    unsigned int n = (unsigned int)count;
+    put(out, &n, sizeof(n));
+}
+
+// Parameters as stored in the header, compared field by field
+static void writeParameters(std::vector<unsigned char>& out, const FitParameters& params) {
+    put(out, &params.cubeSide, sizeof(params.cubeSide));
+    put(out, params.rad, sizeof(params.rad));
+    put(out, &params.bboardSize, sizeof(params.bboardSize));
+    put(out, &params.voxelSize, sizeof(params.voxelSize));
+    put(out, &params.sdfBand, sizeof(params.sdfBand));
+    unsigned char adaptive = params.adaptive;
+    put(out, &adaptive, sizeof(adaptive));
+    put(out, &params.minRadius, sizeof(params.minRadius));
+    put(out, &params.maxRadius, sizeof(params.maxRadius));
+    put(out, &params.sphereBudget, sizeof(params.sphereBudget));
+}
+
+// Reads plain values from a byte buffer, fails instead of reading past its end
+struct CacheReader {
+    const unsigned char* data;
+    size_t size, pos;
+
+    bool get(void* value, size_t bytes) {
+        if (bytes > size - pos) return false;
+        memcpy(value, data + pos, bytes);
+        pos += bytes;
+        return true;
+    }
+    bool getCount(size_t& count, size_t elementSize) {
+        unsigned int n;
+        if (!get(&n, sizeof(n)) || (size_t)n * elementSize > size - pos) return false;
+        count = n;
+        return true;
+    }
+};
+
+bool saveFitCache(const std::string& path, unsigned long long meshHash, const FitParameters& params,
+                  const FitData& data) {
+    std::vector<unsigned char> out;
+    put(out, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    put(out, &CACHE_VERSION, sizeof(CACHE_VERSION));
+    put(out, &meshHash, sizeof(meshHash));
+    writeParameters(out, params);
+
+    put(out, data.limits, sizeof(data.limits));
+    for (int i = 0; i < 5; i++) {
+        putCount(out, data.slabVertices[i].size());
+        put(out, data.slabVertices[i].data(), data.slabVertices[i].size() * sizeof(vec3));
+    }
+    putCount(out, data.spheres.size());
+    put(out, data.spheres.data(), data.spheres.size() * sizeof(vec4));
+    putCount(out, data.billboardMap.size());
+    for (int i = 0; i < data.billboardMap.size(); i++) {
+        // 8 cells per byte
+        const std::vector<bool>& map = data.billboardMap[i];
+        std::vector<unsigned char> bits((map.size() + 7) / 8, 0);
+        for (size_t c = 0; c < map.size(); c++)
+            if (map[c]) bits[c / 8] |= 1 << (c % 8);
+        putCount(out, map.size());
+        put(out, bits.data(), bits.size());
+    }
+    putCount(out, data.levels.size());
+    put(out, data.levels.data(), data.levels.size() * sizeof(float));
+
+    // The voxel grid, 8 cells per byte
+    const VoxelGrid& voxels = data.voxels;
+    put(out, &voxels.lo, sizeof(vec3));
+    put(out, &voxels.cellSize, sizeof(voxels.cellSize));
+    put(out, voxels.dims, sizeof(voxels.dims));
+    std::vector<unsigned char> cellBits((voxels.cells.size() + 7) / 8, 0);
+    for (size_t c = 0; c < voxels.cells.size(); c++)
+        if (voxels.cells[c]) cellBits[c / 8] |= 1 << (c % 8);
+    putCount(out, voxels.cells.size());
+    put(out, cellBits.data(), cellBits.size());
+
+    // The distance field, with the samples of its dense bricks quantized to
+    // 16 bits over [-band, band] (steps of band / 32767, far below its error)
+    const SignedDistanceField& field = data.field;
+    put(out, &field.origin, sizeof(vec3));
+    put(out, &field.cellSize, sizeof(field.cellSize));
+    put(out, &field.band, sizeof(field.band));
+    put(out, field.bricks, sizeof(field.bricks));
+    putCount(out, field.brickStart.size());
+    put(out, field.brickStart.data(), field.brickStart.size() * sizeof(int));
+    put(out, field.brickValue.data(), field.brickValue.size() * sizeof(float));
+    std::vector<short> quantized(field.samples.size());
+    for (size_t s = 0; s < field.samples.size(); s++) {
+        float u = field.band > 0.0f ? field.samples[s] / field.band : 0.0f;
+        quantized[s] = (short)std::floor(std::max(-1.0f, std::min(1.0f, u)) * 32767.0f + 0.5f);
+    }
+    putCount(out, quantized.size());
+    put(out, quantized.data(), quantized.size() * sizeof(short));
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) return false;
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    return fclose(file) == 0 && written;
+}
+
+bool loadFitCache(const std::string& path, unsigned long long meshHash, const FitParameters& params,
+                  FitData& data) {
+    // The whole file is read at once and decoded from memory. Reading the
+    // 20 MB of the body cache takes 2 to 8 ms of a 55 ms load, the rest is
+    // decoding, so mapping the file instead would not pay for the platform code.
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+    std::vector<unsigned char> in;
+    long length = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    bool read = length >= 0 && fseek(file, 0, SEEK_SET) == 0;
+    if (read) {
+        in.resize(length);
+        read = fread(in.data(), 1, in.size(), file) == in.size();
+    }
+    fclose(file);
+    if (!read) return false;
+
+    // The header must match this build, this mesh and these parameters
+    std::vector<unsigned char> header;
+    put(header, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    put(header, &CACHE_VERSION, sizeof(CACHE_VERSION));
+    put(header, &meshHash, sizeof(meshHash));
+    writeParameters(header, params);
+    if (in.size() < header.size() || memcmp(in.data(), header.data(), header.size()) != 0) return false;
+
+    CacheReader reader = { in.data(), in.size(), header.size() };
+    size_t count;
+    if (!reader.get(data.limits, sizeof(data.limits))) return false;
+    for (int i = 0; i < 5; i++) {
+        if (!reader.getCount(count, sizeof(vec3))) return false;
+        data.slabVertices[i].resize(count);
+        reader.get(data.slabVertices[i].data(), count * sizeof(vec3));
+    }
+    if (!reader.getCount(count, sizeof(vec4))) return false;
+    data.spheres.resize(count);
+    reader.get(data.spheres.data(), count * sizeof(vec4));
+    if (!reader.getCount(count, 1)) return false;
+    data.billboardMap.assign(count, std::vector<bool>());
+    for (int i = 0; i < data.billboardMap.size(); i++) {
+        size_t cells;
+        if (!reader.getCount(cells, 0) || (cells + 7) / 8 > reader.size - reader.pos) return false;
+        const unsigned char* bits = reader.data + reader.pos;
+        data.billboardMap[i].resize(cells);
+        for (size_t c = 0; c < cells; c++)
+            data.billboardMap[i][c] = (bits[c / 8] >> (c % 8)) & 1;
+        reader.pos += (cells + 7) / 8;
+    }
+    if (!reader.getCount(count, sizeof(float))) return false;
+    data.levels.resize(count);
+    reader.get(data.levels.data(), count * sizeof(float));
+
+    VoxelGrid& voxels = data.voxels;
+    if (!reader.get(&voxels.lo, sizeof(vec3)) || !reader.get(&voxels.cellSize, sizeof(voxels.cellSize)) ||
+        !reader.get(voxels.dims, sizeof(voxels.dims)))
+        return false;
+    if (!reader.getCount(count, 0) || (count + 7) / 8 > reader.size - reader.pos ||
+        count != (size_t)voxels.dims[0] * voxels.dims[1] * voxels.dims[2])
+        return false;
+    voxels.cells.resize(count);
+    for (size_t c = 0; c < count; c++)
+        voxels.cells[c] = (reader.data[reader.pos + c / 8] >> (c % 8)) & 1;
+    reader.pos += (count + 7) / 8;
+
+    SignedDistanceField& field = data.field;
+    if (!reader.get(&field.origin, sizeof(vec3)) || !reader.get(&field.cellSize, sizeof(field.cellSize)) ||
+        !reader.get(&field.band, sizeof(field.band)) || !reader.get(field.bricks, sizeof(field.bricks)))
+        return false;
+    if (!reader.getCount(count, sizeof(int) + sizeof(float)) ||
+        count != (size_t)field.bricks[0] * field.bricks[1] * field.bricks[2])
+        return false;
+    field.brickStart.resize(count);
+    field.brickValue.resize(count);
+    reader.get(field.brickStart.data(), count * sizeof(int));
+    reader.get(field.brickValue.data(), count * sizeof(float));
+    if (!reader.getCount(count, sizeof(short))) return false;
+    field.samples.resize(count);
+    const short* quantized = (const short*)(reader.data + reader.pos);
+    for (size_t s = 0; s < count; s++) {
+        short q;
+        memcpy(&q, quantized + s, sizeof(q));
+        field.samples[s] = q * (field.band / 32767.0f);
+    }
+    reader.pos += count * sizeof(short);
+    // every dense brick must lie within the samples
+    const int brickSamples = (SignedDistanceField::BRICK + 1) * (SignedDistanceField::BRICK + 1) *
+                             (SignedDistanceField::BRICK + 1);
+    for (size_t b = 0; b < field.brickStart.size(); b++) {
+        int start = field.brickStart[b];
+        if (start < -1 || (start >= 0 && (size_t)start + brickSamples > field.samples.size())) return false;
+    }
+    return reader.pos == reader.size && !voxels.empty() && !field.empty();
+}
@@ -0,0 +1,67 @@
+#ifndef EFFECT_CACHE_H
+#define EFFECT_CACHE_H
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "VoxelGrid.h"
+#include "SignedDistanceField.h"
+
+/** Parameters the fit data depends on, besides the mesh. The defaults are the ones of the game. */
+struct FitParameters {
+    /** sphere fitting step in cm and the radii tried, largest first */
+    int cubeSide;
+    float rad[3];
+    /** billboard side */
+    float bboardSize;
+    /** voxel side and distance field band of the inside tests */
+    float voxelSize;
+    float sdfBand;
+    /**
+     * octree packing instead of the grid: radii from minRadius to maxRadius,
+     * at most sphereBudget spheres (0: no limit). The distance field band
+     * is raised to maxRadius if it is below it.
+     */
+    bool adaptive;
+    float minRadius, maxRadius;
+    int sphereBudget;
+
+    FitParameters();
+};
+
+/**
+ * Everything the startup derives from the body mesh: the limits of the 5
+ * slabs, the triangles of each slab, the fitted spheres (center, radius),
+ * the billboard maps and their levels, and the voxel grid and signed
+ * distance field of the inside tests, kept for the effects that query
+ * the body later
+ */
+struct FitData {
+    float limits[5][6];
+    std::vector<glm::vec3> slabVertices[5];
+    std::vector<glm::vec4> spheres;
+    std::vector<std::vector<bool>> billboardMap;
+    std::vector<float> levels;
+    VoxelGrid voxels;
+    SignedDistanceField field;
+};
+
+/** 64 bit FNV-1a hash of the vertices of a mesh, the cache key of its content */
+unsigned long long hashMesh(const std::vector<glm::vec3>& vertices);
+/**
+ * Compute the fit data of a mesh from scratch. bodyBVH must hold the
+ * hierarchy of the same mesh, the voxel grid and the distance field are
+ * built on it.
+ */
+void bakeFitData(const std::vector<glm::vec3>& vertices, const FitParameters& params, FitData& data);
+/**
+ * Read the fit data from a cache file. Returns false if it is missing,
+ * damaged, of another version or made for another mesh or parameters.
+ */
+bool loadFitCache(const std::string& path, unsigned long long meshHash, const FitParameters& params,
+                  FitData& data);
+/** Write the fit data to a cache file, returns false if it could not be written */
+bool saveFitCache(const std::string& path, unsigned long long meshHash, const FitParameters& params,
+                  const FitData& data);
+
+#endif
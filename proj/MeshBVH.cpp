@@ -0,0 +1,288 @@
+#include "MeshBVH.h"
+#include <algorithm>
+#include <cassert>
+
+using namespace glm;
+
+// Nodes of at most LEAF_SIZE triangles are always leaves, nodes of more
+// than MAX_LEAF_SIZE are always split. The SAH is evaluated at the
+// boundaries of BINS bins of the centroids per axis.
+static const int LEAF_SIZE = 2;
+static const int MAX_LEAF_SIZE = 8;
+static const int BINS = 12;
+// From SAH_DEPTH on the nodes are split at their median, which halves them
+// and bounds the depth by SAH_DEPTH + log2(triangles) whatever the SAH
+// would have done on clustered geometry. The traversals keep at most
+// height + 1 nodes on their STACK_SIZE stack.
+static const int SAH_DEPTH = 32;
+static const int STACK_SIZE = 64;
+
+// Surface area of a box, infinite boxes (empty) count as none
+static float boxArea(const vec3& lo, const vec3& hi) {
+    vec3 d = max(hi - lo, vec3(0.0f));
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void MeshBVH::build(const std::vector<vec3>& vertices) {
+    int count = (int)vertices.size() / 3;
+    std::vector<int> order(count);
+    std::vector<vec3> centroids(count);
+    for (int t = 0; t < count; t++) {
+        order[t] = t;
+        centroids[t] = (vertices[3 * t] + vertices[3 * t + 1] + vertices[3 * t + 2]) / 3.0f;
+    }
+
+    nodes.clear();
+    nodes.reserve(2 * count / LEAF_SIZE + 1);
+    Node root;
+    root.first = 0;
+    root.count = count;
+    nodes.push_back(root);
+    height = 0;
+    split(0, 0, order, centroids, vertices);
+
+    // Store the triangles in leaf order, so that a leaf reads them contiguously
+    triangles.resize(3 * count);
+    for (int t = 0; t < count; t++)
+        for (int k = 0; k < 3; k++)
+            triangles[3 * t + k] = vertices[3 * order[t] + k];
+}
+
+void MeshBVH::split(int n, int level, std::vector<int>& order, const std::vector<vec3>& centroids,
+                    const std::vector<vec3>& vertices) {
+    int first = nodes[n].first, count = nodes[n].count;
+    vec3 lo(1e30f), hi(-1e30f), cLo(1e30f), cHi(-1e30f);
+    for (int t = first; t < first + count; t++) {
+        for (int k = 0; k < 3; k++) {
+            lo = min(lo, vertices[3 * order[t] + k]);
+            hi = max(hi, vertices[3 * order[t] + k]);
+        }
+        cLo = min(cLo, centroids[order[t]]);
+        cHi = max(cHi, centroids[order[t]]);
+    }
+    nodes[n].lo = lo;
+    nodes[n].hi = hi;
+    height = std::max(height, level);
+    if (count <= LEAF_SIZE) return;
+
+    // Binned SAH: the cost of a split is the triangles of each side weighted
+    // by the area of its box, a leaf costs its triangles by the node area
+    int bestAxis = -1, bestBin = 0;
+    float bestCost = count * boxArea(lo, hi);
+    for (int axis = 0; axis < 3 && level < SAH_DEPTH; axis++) {
+        float extent = cHi[axis] - cLo[axis];
+        if (extent <= 0.0f) continue;
+        float scale = BINS / extent;
+        int binCount[BINS] = { 0 };
+        vec3 binLo[BINS], binHi[BINS];
+        for (int b = 0; b < BINS; b++) {
+            binLo[b] = vec3(1e30f);
+            binHi[b] = vec3(-1e30f);
+        }
+        for (int t = first; t < first + count; t++) {
+            int b = std::min(BINS - 1, (int)((centroids[order[t]][axis] - cLo[axis]) * scale));
+            binCount[b]++;
+            for (int k = 0; k < 3; k++) {
+                binLo[b] = min(binLo[b], vertices[3 * order[t] + k]);
+                binHi[b] = max(binHi[b], vertices[3 * order[t] + k]);
+            }
+        }
+        // sweep from the right for the right side areas, then from the left
+        float rightArea[BINS];
+        int rightCount[BINS];
+        vec3 rLo(1e30f), rHi(-1e30f);
+        int rCount = 0;
+        for (int b = BINS - 1; b > 0; b--) {
+            rLo = min(rLo, binLo[b]);
+            rHi = max(rHi, binHi[b]);
+            rCount += binCount[b];
+            rightArea[b] = boxArea(rLo, rHi);
+            rightCount[b] = rCount;
+        }
+        vec3 lLo(1e30f), lHi(-1e30f);
+        int lCount = 0;
+        for (int b = 1; b < BINS; b++) {
+            lLo = min(lLo, binLo[b - 1]);
+            lHi = max(lHi, binHi[b - 1]);
+            lCount += binCount[b - 1];
+            if (lCount == 0 || rightCount[b] == 0) continue;
+            float cost = lCount * boxArea(lLo, lHi) + rightCount[b] * rightArea[b];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    int half;
+    if (bestAxis >= 0) {
+        // the triangles of the bins left of the best boundary go first
+        int axis = bestAxis, bin = bestBin;
+        float low = cLo[axis], scale = BINS / (cHi[axis] - cLo[axis]);
+        half = (int)(std::partition(order.begin() + first, order.begin() + first + count,
+                                    [&centroids, axis, bin, low, scale](int t) {
+            return std::min(BINS - 1, (int)((centroids[t][axis] - low) * scale)) < bin;
+        }) - (order.begin() + first));
+    }
+    else if (count <= MAX_LEAF_SIZE) return;
+    else {
+        // no split beats the leaf but it is too large, or the node is too
+        // deep for the SAH: median split along the longest axis of the centroids
+        vec3 extent = cHi - cLo;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        half = count / 2;
+        std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                         [&centroids, axis](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+    }
+
+    int left = (int)nodes.size();
+    Node child;
+    child.first = first;
+    child.count = half;
+    nodes.push_back(child);
+    child.first = first + half;
+    child.count = count - half;
+    nodes.push_back(child);
+    nodes[n].first = left;
+    nodes[n].count = 0;
+    split(left, level + 1, order, centroids, vertices);
+    split(left + 1, level + 1, order, centroids, vertices);
+}
+
+// Closest point of triangle abc to p (Ericson, Real-Time Collision Detection 5.1.5)
+static vec3 closestPointTriangle(const vec3& p, const vec3& a, const vec3& b, const vec3& c) {
+    vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = dot(ab, ap), d2 = dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) return a;
+    vec3 bp = p - b;
+    float d3 = dot(ab, bp), d4 = dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) return b;
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+    vec3 cp = p - c;
+    float d5 = dot(ab, cp), d6 = dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) return c;
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+int MeshBVH::rayCrossings(const vec3& origin, const vec3& dir) const {
+    std::vector<float> hits;
+    rayHits(origin, dir, hits);
+    return (int)hits.size();
+}
+
+void MeshBVH::rayHits(const vec3& origin, const vec3& dir, std::vector<float>& hits) const {
+    hits.clear();
+    if (nodes.empty()) return;
+    const float epsilon = 0.0000001f;
+    vec3 inv = 1.0f / dir;
+    assert(height < STACK_SIZE);
+    int stack[STACK_SIZE], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node& node = nodes[stack[--top]];
+        // slab test, the ray starts at origin and has no end
+        vec3 t0 = (node.lo - origin) * inv, t1 = (node.hi - origin) * inv;
+        vec3 tNear = min(t0, t1), tFar = max(t0, t1);
+        float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+        float exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+        // a zero direction component gives NaN on a slab boundary, test it directly
+        bool inside = true;
+        for (int k = 0; k < 3; k++) {
+            if (dir[k] == 0.0f && (origin[k] < node.lo[k] || origin[k] > node.hi[k])) inside = false;
+        }
+        if (!inside || enter > exit) continue;
+        if (node.count == 0) {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+        for (int t = node.first; t < node.first + node.count; t++) {
+            // Moller-Trumbore
+            const vec3& v0 = triangles[3 * t];
+            vec3 edge1 = triangles[3 * t + 1] - v0, edge2 = triangles[3 * t + 2] - v0;
+            vec3 h = cross(dir, edge2);
+            float a = dot(edge1, h);
+            if (a > -epsilon && a < epsilon) continue;
+            float f = 1.0f / a;
+            vec3 s = origin - v0;
+            float u = f * dot(s, h);
+            if (u < 0.0f || u > 1.0f) continue;
+            vec3 q = cross(s, edge1);
+            float v = f * dot(dir, q);
+            if (v < 0.0f || u + v > 1.0f) continue;
+            float distance = f * dot(edge2, q);
+            if (distance > epsilon) hits.push_back(distance);
+        }
+    }
+}
+
+float MeshBVH::distance(const vec3& p, float maxDistance) const {
+    float best2 = maxDistance * maxDistance;
+    if (nodes.empty()) return maxDistance;
+    assert(height < STACK_SIZE);
+    int stack[STACK_SIZE], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node& node = nodes[stack[--top]];
+        // skip the boxes farther than the closest triangle so far
+        vec3 d = max(max(node.lo - p, p - node.hi), vec3(0.0f));
+        if (dot(d, d) >= best2) continue;
+        if (node.count == 0) {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+        for (int t = node.first; t < node.first + node.count; t++) {
+            vec3 e = p - closestPointTriangle(p, triangles[3 * t], triangles[3 * t + 1], triangles[3 * t + 2]);
+            best2 = std::min(best2, dot(e, e));
+        }
+    }
+    return sqrt(best2);
+}
+
+bool MeshBVH::collideSphere(const vec3& center, float r, float level, vec3& normal, float& depth) const {
+    if (nodes.empty()) return false;
+    depth = 0.0f;
+    assert(height < STACK_SIZE);
+    int stack[STACK_SIZE], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node& node = nodes[stack[--top]];
+        // skip the boxes the sphere does not reach and the dissolved part
+        if (node.lo.y > level) continue;
+        if (any(greaterThan(node.lo, center + r)) || any(lessThan(node.hi, center - r))) continue;
+        if (node.count == 0) {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+        for (int t = node.first; t < node.first + node.count; t++) {
+            const vec3& a = triangles[3 * t];
+            const vec3& b = triangles[3 * t + 1];
+            const vec3& c = triangles[3 * t + 2];
+            vec3 p = closestPointTriangle(center, a, b, c);
+            if (p.y > level) continue;
+            vec3 d = center - p;
+            float dist2 = dot(d, d);
+            if (dist2 >= r * r) continue;
+            // only from the outside (front face), the spheres that are
+            // still inside the body fall through it
+            vec3 n = cross(b - a, c - a);
+            if (dot(d, n) <= 0.0f) continue;
+            float dist = sqrt(dist2);
+            if (r - dist > depth) {
+                depth = r - dist;
+                normal = dist > 0.0f ? d / dist : normalize(n);
+            }
+        }
+    }
+    return depth > 0.0f;
+}
@@ -0,0 +1,56 @@
+#ifndef MESH_BVH_H
+#define MESH_BVH_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+/**
+ * Bounding volume hierarchy over the triangles of a mesh, in model space.
+ * It is built once per mesh and shared by every instance of the model,
+ * the queries take the position of the instance into account. The nodes
+ * are split where the surface area heuristic expects the cheapest queries.
+ */
+class MeshBVH {
+public:
+    /**
+     * Flat node array, the children of an inner node are stored next to each
+     * other at first and first + 1. A leaf holds count triangles from first.
+     */
+    struct Node {
+        glm::vec3 lo, hi;
+        int first, count;
+    };
+    std::vector<Node> nodes;
+    /** triangle corners, 3 per triangle in leaf order */
+    std::vector<glm::vec3> triangles;
+    /** depth of the deepest leaf, the root is at 0 */
+    int height;
+
+    /** Build the hierarchy over a triangle soup (3 vertices per triangle) */
+    void build(const std::vector<glm::vec3>& vertices);
+    /**
+     * Number of triangles (either side) the ray from origin along dir
+     * crosses, with the Moller-Trumbore test
+     */
+    int rayCrossings(const glm::vec3& origin, const glm::vec3& dir) const;
+    /** Distances (in units of dir, unsorted) along the ray to every triangle it crosses */
+    void rayHits(const glm::vec3& origin, const glm::vec3& dir, std::vector<float>& hits) const;
+    /** Distance from p to the closest triangle, or maxDistance if none is closer */
+    float distance(const glm::vec3& p, float maxDistance) const;
+    /** Whether p is inside a closed mesh: the ray along +z crosses it an odd number of times */
+    bool pointInside(const glm::vec3& p) const { return rayCrossings(p, glm::vec3(0.0f, 0.0f, 1.0f)) % 2 == 1; }
+    /**
+     * Deepest contact of a sphere (model space) with the outside of the
+     * triangles, counting only the surface below level. Returns false if
+     * there is none, otherwise the normal pointing out of the mesh and the
+     * penetration depth.
+     */
+    bool collideSphere(const glm::vec3& center, float r, float level, glm::vec3& normal, float& depth) const;
+
+private:
+    /** Split the triangles [first, first + count) of node n at depth level until the leaves are small */
+    void split(int n, int level, std::vector<int>& order, const std::vector<glm::vec3>& centroids,
+               const std::vector<glm::vec3>& vertices);
+};
+
+#endif
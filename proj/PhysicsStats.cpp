@@ -0,0 +1,70 @@
+#include "PhysicsStats.h"
+#include <omp.h>
+
+void PhysicsStats::reset() {
+    steps = 0;
+    integrated = 0;
+    candidatePairs = 0;
+    contacts = 0;
+    floorContacts = 0;
+    bodyContacts = 0;
+    sweeps = 0;
+    removed = 0;
+    for (int p = 0; p < PHASES; p++) time[p] = 0.0;
+}
+
+void PhysicsStats::add(const PhysicsStats& other) {
+    steps += other.steps;
+    integrated += other.integrated;
+    candidatePairs += other.candidatePairs;
+    contacts += other.contacts;
+    floorContacts += other.floorContacts;
+    bodyContacts += other.bodyContacts;
+    sweeps += other.sweeps;
+    removed += other.removed;
+    for (int p = 0; p < PHASES; p++) time[p] += other.time[p];
+}
+
+double PhysicsStats::totalTime() const {
+    double total = 0.0;
+    for (int p = 0; p < PHASES; p++) total += time[p];
+    return total;
+}
+
+const char* phaseName(PhysicsStats::Phase phase) {
+    switch (phase) {
+    case PhysicsStats::RELEASE: return "release";
+    case PhysicsStats::FLOOR: return "floor";
+    case PhysicsStats::BODY: return "body";
+    case PhysicsStats::BROADPHASE: return "broadphase";
+    case PhysicsStats::CONTACTS: return "contacts";
+    case PhysicsStats::INTEGRATE: return "integrate";
+    case PhysicsStats::SWEEP: return "sweep";
+    case PhysicsStats::SLEEPING: return "sleeping";
+    case PhysicsStats::SORT: return "sort";
+    case PhysicsStats::REMOVE: return "remove";
+    case PhysicsStats::PLAYBACK: return "playback";
+    default: return "unknown";
+    }
+}
+
+void PhysicsStats::writeCSVHeader(std::ostream& out) {
+    out << "frame,steps,integrated,candidate_pairs,contacts,floor_contacts,body_contacts,sweeps,removed";
+    for (int p = 0; p < PHASES; p++) out << "," << phaseName((Phase)p) << "_us";
+    out << ",total_us\n";
+}
+
+void PhysicsStats::writeCSV(std::ostream& out, int frame) const {
+    out << frame << "," << steps << "," << integrated << "," << candidatePairs << "," << contacts << ","
+        << floorContacts << "," << bodyContacts << "," << sweeps << "," << removed;
+    for (int p = 0; p < PHASES; p++) out << "," << 1e6 * time[p];
+    out << "," << 1e6 * totalTime() << "\n";
+}
+
+PhaseTimer::PhaseTimer(PhysicsStats& stats, PhysicsStats::Phase phase) : stats(stats), phase(phase) {
+    start = omp_get_wtime();
+}
+
+PhaseTimer::~PhaseTimer() {
+    stats.time[phase] += omp_get_wtime() - start;
+}
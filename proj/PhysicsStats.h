@@ -0,0 +1,74 @@
+#ifndef PHYSICS_STATS_H
+#define PHYSICS_STATS_H
+
+#include <ostream>
+
+/**
+ * Counters and time per phase of the sphere simulation, to tell which phase
+ * a slow frame spent its time in. A SphereSystem fills its own for every
+ * step, the main loop sums them (and the removals) per frame.
+ */
+struct PhysicsStats {
+    /** phases of a step, in the order they run */
+    enum Phase {
+        RELEASE,
+        FLOOR,
+        BODY,
+        BROADPHASE,
+        CONTACTS,
+        INTEGRATE,
+        SWEEP,
+        SLEEPING,
+        SORT,
+        REMOVE,
+        PLAYBACK,
+        PHASES
+    };
+
+    /** physics steps taken */
+    int steps;
+    /** spheres advanced by the integration (a sphere of a slow tier counts when it is due) */
+    int integrated;
+    /** pairs found by the broadphase */
+    int candidatePairs;
+    /** candidate pairs that were touching and got resolved */
+    int contacts;
+    /** spheres that hit the floor, and the undissolved body */
+    int floorContacts;
+    int bodyContacts;
+    /** spheres stepped again up to a time of impact by the continuous collision detection */
+    int sweeps;
+    /** spheres removed */
+    int removed;
+    /** seconds spent in each phase */
+    double time[PHASES];
+
+    PhysicsStats() { reset(); }
+    /** Zero every counter and time */
+    void reset();
+    /** Add the counters and times of other */
+    void add(const PhysicsStats& other);
+    /** Seconds spent in every phase together */
+    double totalTime() const;
+
+    /** Write the CSV column names, then one line per frame with writeCSV */
+    static void writeCSVHeader(std::ostream& out);
+    void writeCSV(std::ostream& out, int frame) const;
+};
+
+/** Column name of a phase */
+const char* phaseName(PhysicsStats::Phase phase);
+
+/** Adds the time from its construction to its destruction to a phase */
+class PhaseTimer {
+public:
+    PhaseTimer(PhysicsStats& stats, PhysicsStats::Phase phase);
+    ~PhaseTimer();
+
+private:
+    PhysicsStats& stats;
+    PhysicsStats::Phase phase;
+    double start;
+};
+
+#endif
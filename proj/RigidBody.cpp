@@ -1,4 +1,6 @@
 #include "RigidBody.h"
+#include <algorithm>
+#include <cmath>
 using namespace glm;
 
 RigidBody::RigidBody() {
@@ -12,14 +14,30 @@ RigidBody::RigidBody() {
     R = mat3(1, 0, 0, 0, 1, 0, 0, 0, 1);
 #endif
 
-    I_inv = mat3(1, 0, 0, 0, 1, 0, 0, 0, 1);
+    I_inv = I_body_inv = mat3(1, 0, 0, 0, 1, 0, 0, 0, 1);
+
+    adaptiveStep = 0.004f;
+    acceptedSteps = rejectedSteps = 0;
 }
 
 RigidBody::~RigidBody() {
 }
 
-std::vector<float> RigidBody::getY() {
-    std::vector<float> state(STATES);
+void RigidBody::setInertia(const mat3& I_body) {
+    I_body_inv = inverse(I_body);
+#ifdef USE_QUATERNIONS
+    mat3 R = mat3_cast(q);
+#endif
+    I_inv = R * I_body_inv * transpose(R);
+    w = I_inv * L;
+}
+
+void RigidBody::setInertia(float I) {
+    setInertia(mat3(I));
+}
+
+RigidBody::State RigidBody::getY() const {
+    State state;
     int k = 0;
 
     state[k++] = x.x;
@@ -50,7 +68,7 @@ std::vector<float> RigidBody::getY() {
     return state;
 }
 
-void RigidBody::setY(const std::vector<float>& y) {
+void RigidBody::setY(const State& y) {
     int k = 0;
     x.x = y[k++];
     x.y = y[k++];
@@ -82,33 +100,50 @@ void RigidBody::setY(const std::vector<float>& y) {
 #ifdef USE_QUATERNIONS
     q = normalize(q);
     mat3 R = mat3_cast(q);
-    I_inv = R * I_inv * transpose(R);
+    I_inv = R * I_body_inv * transpose(R);
 #else
     // must ensure that |R| = 1
-    I_inv = R * I_inv * transpose(R);
+    I_inv = R * I_body_inv * transpose(R);
 #endif
 
     // angular momentum
     w = I_inv * L;
 }
 
-std::vector<float> RigidBody::dydt(float t, const std::vector<float>& y) {
-    // store initial state and override state
-    std::vector<float> y0 = getY();
-    setY(y);
-
-    std::vector<float> yDot(STATES);
+RigidBody::State RigidBody::dydt(float t, const State& y) const {
+    // read the quantities needed directly from y instead of overriding
+    // and restoring the state of the body
+    State yDot;
     int k = 0;
 
+#ifdef USE_QUATERNIONS
+    quat q_y = normalize(quat(y[6], y[3], y[4], y[5]));
+    const int p = 7;
+#else
+    mat3 R_y;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            R_y[i][j] = y[3 + 3 * i + j];
+        }
+    }
+    const int p = 12;
+#endif
+    vec3 v_y = vec3(y[p], y[p + 1], y[p + 2]) / m;
+    vec3 L_y = vec3(y[p + 3], y[p + 4], y[p + 5]);
+#ifdef USE_QUATERNIONS
+    mat3 R_y = mat3_cast(q_y);
+#endif
+    vec3 w_y = (R_y * I_body_inv * transpose(R_y)) * L_y;
+
     //yDot = u
-    yDot[k++] = v.x;
-    yDot[k++] = v.y;
-    yDot[k++] = v.z;
+    yDot[k++] = v_y.x;
+    yDot[k++] = v_y.y;
+    yDot[k++] = v_y.z;
 
 #ifdef USE_QUATERNIONS
     //q_dot = 1 / 2 * w * q;
-    quat w_hat = quat(0, w);
-    quat q_dot = (w_hat * q) / 2.0f;
+    quat w_hat = quat(0, w_y);
+    quat q_dot = (w_hat * q_y) / 2.0f;
 
     yDot[k++] = q_dot.x;
     yDot[k++] = q_dot.y;
@@ -116,10 +151,10 @@ std::vector<float> RigidBody::dydt(float t, const std::vector<float>& y) {
     yDot[k++] = q_dot.w;
 #else
     mat3 w_hat = mat3(
-        0, -w.z, w.y,
-        w.z, 0, -w.x,
-        -w.y, w.x, 0);
-    mat3 R_dot = w_hat * R;
+        0, -w_y.z, w_y.y,
+        w_y.z, 0, -w_y.x,
+        -w_y.y, w_y.x, 0);
+    mat3 R_dot = w_hat * R_y;
 
     for (int i = 0; i < 3; i++) {
         for (int j = 0; j < 3; j++) {
@@ -139,58 +174,116 @@ std::vector<float> RigidBody::dydt(float t, const std::vector<float>& y) {
     yDot[k++] = forces[4];
     yDot[k++] = forces[5];
 
-    // restore initial state
-    setY(y0);
-
     return yDot;
 }
 
 float RigidBody::calcKinecticEnergy() {
-    return 0.5f * m * dot(v, v) + 0.5f * dot(w, glm::inverse(I_inv) * w);
+    return 0.5f * m * dot(v, v) + 0.5f * dot(w, L);
 }
 
-std::vector<float> RigidBody::euler(float t, float h, const std::vector<float>& y0) {
-    std::vector<float> y1(STATES);
-    std::vector<float> dydt0 = dydt(t, y0);
+void RigidBody::euler(float t, float h, State& y) const {
+    State dydt0 = dydt(t, y);
     for (int i = 0; i < STATES; i++) {
-        y1[i] = y0[i] + h * dydt0[i];
+        y[i] += h * dydt0[i];
     }
-    return y1;
 }
 
-std::vector<float> RigidBody::rungeKuta4th(float t, float h, const std::vector<float>& y0) {
-    // dydt0 = dydt(x0)
-    std::vector<float> dydt0 = dydt(t, y0);
+void RigidBody::rungeKuta4th(float t, float h, State& y) const {
+    // dydt0 = dydt(y0)
+    State dydt0 = dydt(t, y);
 
     // y1 = y0 + h * dydt0 / 2
-    std::vector<float> y1(STATES);
+    State yk;
     for (int i = 0; i < STATES; i++) {
-        y1[i] = y0[i] + h * dydt0[i] / 2.0f;
+        yk[i] = y[i] + h * dydt0[i] / 2.0f;
     }
-    std::vector<float> dydt1 = dydt(t + h / 2.0f, y1);
+    State dydt1 = dydt(t + h / 2.0f, yk);
 
     // y2 = y0 + h * dydt1 / 2
-    std::vector<float> y2(STATES);
     for (int i = 0; i < STATES; i++) {
-        y2[i] = y0[i] + h * dydt1[i] / 2.0f;
+        yk[i] = y[i] + h * dydt1[i] / 2.0f;
     }
-    std::vector<float> dydt2 = dydt(t + h / 2.0f, y2);
+    State dydt2 = dydt(t + h / 2.0f, yk);
 
-    // y2 = y0 + h * dydt1 / 2
-    std::vector<float> y3(STATES);
+    // y3 = y0 + h * dydt2
     for (int i = 0; i < STATES; i++) {
-        y3[i] = y0[i] + h * dydt2[i];
+        yk[i] = y[i] + h * dydt2[i];
     }
-    std::vector<float> dydt3 = dydt(t + h, y3);
+    State dydt3 = dydt(t + h, yk);
 
     // combine them to estimate the solution.
-    std::vector<float> y4(STATES);
     for (int i = 0; i < STATES; i++) {
-        y4[i] = y0[i] + h * (dydt0[i] + 2.0f * dydt1[i]
-                             + 2.0f * dydt2[i] + dydt3[i]) / 6.0f;
+        y[i] += h * (dydt0[i] + 2.0f * dydt1[i]
+                     + 2.0f * dydt2[i] + dydt3[i]) / 6.0f;
     }
-    return y4;
 }
+
 void RigidBody::advanceState(float t, float h) {
-    setY(rungeKuta4th(t, h, getY()));
-}
\ No newline at end of file
+    State y = getY();
+    rungeKuta4th(t, h, y);
+    setY(y);
+}
+
+float RigidBody::dormandPrince45(float t, float h, State& y) const {
+    // Butcher tableau, the last stage is evaluated at the 5th order solution
+    static const float c[7] = { 0.0f, 1.0f / 5, 3.0f / 10, 4.0f / 5, 8.0f / 9, 1.0f, 1.0f };
+    static const float a[7][6] = {
+        { 0 },
+        { 1.0f / 5 },
+        { 3.0f / 40, 9.0f / 40 },
+        { 44.0f / 45, -56.0f / 15, 32.0f / 9 },
+        { 19372.0f / 6561, -25360.0f / 2187, 64448.0f / 6561, -212.0f / 729 },
+        { 9017.0f / 3168, -355.0f / 33, 46732.0f / 5247, 49.0f / 176, -5103.0f / 18656 },
+        { 35.0f / 384, 0.0f, 500.0f / 1113, 125.0f / 192, -2187.0f / 6784, 11.0f / 84 } };
+    // difference of the 5th and the 4th order weights
+    static const float e[7] = { 71.0f / 57600, 0.0f, -71.0f / 16695, 71.0f / 1920,
+                                -17253.0f / 339200, 22.0f / 525, -1.0f / 40 };
+
+    State k[7], yk;
+    k[0] = dydt(t, y);
+    for (int s = 1; s < 7; s++) {
+        for (int i = 0; i < STATES; i++) {
+            float sum = 0.0f;
+            for (int j = 0; j < s; j++) sum += a[s][j] * k[j][i];
+            yk[i] = y[i] + h * sum;
+        }
+        k[s] = dydt(t + c[s] * h, yk);
+    }
+
+    float error = 0.0f;
+    for (int i = 0; i < STATES; i++) {
+        float sum = 0.0f;
+        for (int j = 0; j < 7; j++) sum += e[j] * k[j][i];
+        error = std::max(error, std::abs(h * sum) / (1.0f + std::abs(yk[i])));
+    }
+    y = yk;
+    return error;
+}
+
+void RigidBody::advanceStateAdaptive(float t, float h, float tolerance) {
+    const float minStep = 1e-6f;
+    State y = getY();
+    float remaining = h;
+    while (remaining > 0.0f) {
+        float step = std::min(adaptiveStep, remaining);
+        State yNext = y;
+        float error = dormandPrince45(t, step, yNext);
+
+        // h_new = 0.9 h (tolerance / error)^(1/5), changing at most 5 times
+        float scale = error > 0.0f ? 0.9f * std::pow(tolerance / error, 0.2f) : 5.0f;
+        float next = step * std::min(5.0f, std::max(0.2f, scale));
+        if (error <= tolerance || step <= minStep) {
+            y = yNext;
+            t += step;
+            remaining -= step;
+            acceptedSteps++;
+            // a step cut short by the end of the interval says nothing about growing
+            if (step == adaptiveStep || next < adaptiveStep) adaptiveStep = next;
+        }
+        else {
+            rejectedSteps++;
+            adaptiveStep = std::max(next, minStep);
+        }
+    }
+    setY(y);
+}
@@ -1,6 +1,7 @@
 #ifndef RIGID_BODY_H
 #define RIGID_BODY_H
 
+#include <array>
 #include <vector>
 #include <functional>
 #include <glm/glm.hpp>
@@ -16,12 +17,20 @@ public:
 #else
     static const int STATES = 18;
 #endif
+    /**
+     * State vector y = [x, q (or R), P, L]. Its size is known at compile time,
+     * so the integrators below never touch the heap.
+     */
+    typedef std::array<float, STATES> State;
+
     /** m: mass */
     float m;
     /** x: position, v: velocity, w: angular velocity */
     glm::vec3 x, v, w;
-    /** I_inv: inverse inertia matrix */
+    /** I_inv: inverse inertia matrix (world space) */
     glm::mat3 I_inv;
+    /** I_body_inv: inverse inertia matrix (body space), set with setInertia */
+    glm::mat3 I_body_inv;
     /** the orientation of a rigid body can be encoded by a 3D rotation matrix
     or by a quaternion */
 #ifdef USE_QUATERNIONS
@@ -31,34 +40,59 @@ public:
 #endif
     /** P: momentum, L: angular momentum */
     glm::vec3 P, L;
+    /** size of the next adaptive step, grown or shrunk to keep the error within the tolerance */
+    float adaptiveStep;
+    /** accepted and rejected adaptive steps so far, to tune the tolerance against the cost */
+    int acceptedSteps, rejectedSteps;
     /**
      * The forcing function accepts t, y and returns a vector of 6 floats
      * [fx, fy, fz, taux, tauy, tauz] corresponding to the values of the
      * applied forces. By default zero forces are applied, otherwise the user
-     * must specify the forcing function.
+     * must specify the forcing function. This is the general, slow path: the
+     * spheres of a SphereSystem use its ForceField, inlined by the kernels.
      */
-    std::function<std::vector<float>(float t, const std::vector<float>& y)> forcing =
-        [](float t, const std::vector<float>& y)->std::vector<float> {
+    std::function<std::vector<float>(float t, const State& y)> forcing =
+        [](float t, const State& y)->std::vector<float> {
         std::vector<float> f(6, 0.0f);
         return f;
     };
 
     RigidBody();
     ~RigidBody();
+    /** Set the inertia matrix (body space) */
+    void setInertia(const glm::mat3& I_body);
+    /** Set an isotropic inertia I * identity */
+    void setInertia(float I);
     /** Get state vector y */
-    std::vector<float> getY();
-    /** Get state vector y */
-    void setY(const std::vector<float>& y);
-    /** Get state derivative vector dy / dt */
-    std::vector<float> dydt(float t, const std::vector<float>& y);
-    /** Calculate the kinetic energy of the rigid body KE = 1/2 m u^T u + 1/2 w^T I w */
+    State getY() const;
+    /** Set state vector y */
+    void setY(const State& y);
+    /** Get state derivative vector dy / dt, without modifying the body */
+    State dydt(float t, const State& y) const;
+    /**
+     * Calculate the kinetic energy of the rigid body KE = 1/2 m u^T u + 1/2 w^T I w,
+     * with I w = L
+     */
     float calcKinecticEnergy();
-    /** Euler method for advancing the state y(t + h) = y(t) + h dy(t) / dt */
-    std::vector<float> euler(float t, float h, const std::vector<float>& y0);
-    /** Runge-Kutta 4th order for advancing the state (error/step ~ O(h^5) */
-    std::vector<float> rungeKuta4th(float t, float h, const std::vector<float>& y0);
+    /** Euler method for advancing the state in place y(t + h) = y(t) + h dy(t) / dt */
+    void euler(float t, float h, State& y) const;
+    /** Runge-Kutta 4th order for advancing the state in place (error/step ~ O(h^5) */
+    void rungeKuta4th(float t, float h, State& y) const;
+    /**
+     * Dormand-Prince embedded Runge-Kutta 5(4) for advancing the state in
+     * place with the 5th order solution. Returns the local error estimate,
+     * the largest difference from the embedded 4th order solution relative
+     * to 1 + |y|.
+     */
+    float dormandPrince45(float t, float h, State& y) const;
     /** Advances the state from t to t + h using Euler or RunkeKutta */
     void advanceState(float t, float h);
+    /**
+     * Advances the state from t to t + h in Dormand-Prince steps of
+     * adaptiveStep, rejecting and retrying the steps whose error exceeds the
+     * tolerance and adapting the step size after each one
+     */
+    void advanceStateAdaptive(float t, float h, float tolerance);
 };
 
 #endif
@@ -0,0 +1,94 @@
+#include "SignedDistanceField.h"
+#include "MeshBVH.h"
+#include "VoxelGrid.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace glm;
+
+SignedDistanceField::SignedDistanceField() {
+    origin = vec3(0.0f);
+    cellSize = 0.0f;
+    band = 0.0f;
+    bricks[0] = bricks[1] = bricks[2] = 0;
+}
+
+// Whether the cell (ix, iy, iz) of the grid is inside, cells off the grid are not
+static bool cellInside(const VoxelGrid& voxels, int ix, int iy, int iz) {
+    if (ix >= voxels.dims[0] || iy >= voxels.dims[1] || iz >= voxels.dims[2]) return false;
+    return voxels.cells[((size_t)iz * voxels.dims[1] + iy) * voxels.dims[0] + ix] != 0;
+}
+
+void SignedDistanceField::build(const MeshBVH& mesh, const VoxelGrid& voxels, float band) {
+    const int S = BRICK + 1;
+    cellSize = voxels.cellSize;
+    this->band = band;
+    origin = voxels.lo + vec3(0.5f * cellSize);
+    for (int k = 0; k < 3; k++) bricks[k] = std::max(1, (voxels.dims[k] - 1 + BRICK - 1) / BRICK);
+    int count = bricks[0] * bricks[1] * bricks[2];
+    brickStart.assign(count, -1);
+    brickValue.assign(count, -band);
+    samples.clear();
+
+    // A brick is dense if the surface passes within band of it, tested from
+    // its center sample against its half diagonal
+    float reach = 0.5f * std::sqrt(3.0f) * BRICK * cellSize + band;
+    std::vector<unsigned char> dense(count, 0);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < count; b++) {
+        int bx = b % bricks[0], by = (b / bricks[0]) % bricks[1], bz = b / (bricks[0] * bricks[1]);
+        int cx = bx * BRICK + BRICK / 2, cy = by * BRICK + BRICK / 2, cz = bz * BRICK + BRICK / 2;
+        vec3 center = origin + vec3(cx, cy, cz) * cellSize;
+        dense[b] = mesh.distance(center, reach) < reach;
+        brickValue[b] = cellInside(voxels, cx, cy, cz) ? band : -band;
+    }
+    for (int b = 0; b < count; b++) {
+        if (!dense[b]) continue;
+        brickStart[b] = (int)samples.size();
+        samples.resize(samples.size() + S * S * S);
+    }
+
+    // Samples of the dense bricks, the ones on a brick boundary are shared
+    // in space and computed once per brick
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < count; b++) {
+        if (brickStart[b] < 0) continue;
+        int bx = b % bricks[0], by = (b / bricks[0]) % bricks[1], bz = b / (bricks[0] * bricks[1]);
+        float* s = &samples[brickStart[b]];
+        for (int z = 0; z < S; z++) {
+            for (int y = 0; y < S; y++) {
+                for (int x = 0; x < S; x++) {
+                    int ix = bx * BRICK + x, iy = by * BRICK + y, iz = bz * BRICK + z;
+                    float d = mesh.distance(origin + vec3(ix, iy, iz) * cellSize, band);
+                    s[(z * S + y) * S + x] = cellInside(voxels, ix, iy, iz) ? d : -d;
+                }
+            }
+        }
+    }
+}
+
+float SignedDistanceField::distance(const vec3& p) const {
+    const int S = BRICK + 1;
+    assert(!empty());
+    vec3 u = (p - origin) / cellSize;
+    if (u.x < 0.0f || u.y < 0.0f || u.z < 0.0f) return -band;
+    int bx = (int)u.x / BRICK, by = (int)u.y / BRICK, bz = (int)u.z / BRICK;
+    if (bx >= bricks[0] || by >= bricks[1] || bz >= bricks[2]) return -band;
+    int b = (bz * bricks[1] + by) * bricks[0] + bx;
+    if (brickStart[b] < 0) return brickValue[b];
+
+    // Trilinear interpolation inside the brick
+    vec3 local = u - vec3(bx, by, bz) * (float)BRICK;
+    int x = std::min((int)local.x, BRICK - 1), y = std::min((int)local.y, BRICK - 1);
+    int z = std::min((int)local.z, BRICK - 1);
+    vec3 f = local - vec3(x, y, z);
+    const float* s = &samples[brickStart[b] + (z * S + y) * S + x];
+    float c00 = mix(s[0], s[1], f.x), c10 = mix(s[S], s[S + 1], f.x);
+    float c01 = mix(s[S * S], s[S * S + 1], f.x), c11 = mix(s[S * S + S], s[S * S + S + 1], f.x);
+    return mix(mix(c00, c10, f.y), mix(c01, c11, f.y), f.z);
+}
+
+int SignedDistanceField::denseBricks() const {
+    return (int)samples.size() / ((BRICK + 1) * (BRICK + 1) * (BRICK + 1));
+}
@@ -0,0 +1,50 @@
+#ifndef SIGNED_DISTANCE_FIELD_H
+#define SIGNED_DISTANCE_FIELD_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+class MeshBVH;
+class VoxelGrid;
+
+/**
+ * Sampled signed distance to the surface of a closed mesh, positive inside.
+ * The samples lie on the centers of the cells of its voxel grid and are
+ * grouped in bricks of BRICK^3 cells. Only the bricks the surface passes
+ * within band of store their samples, the rest hold one value (+band deep
+ * inside, -band far outside), so the field is clamped to [-band, band].
+ */
+class SignedDistanceField {
+public:
+    /** cells per brick side, a brick stores (BRICK + 1)^3 samples to interpolate on its own */
+    static const int BRICK = 8;
+
+    /** first sample, sample spacing, clamp distance and bricks per axis */
+    glm::vec3 origin;
+    float cellSize;
+    float band;
+    int bricks[3];
+    /** first sample of every brick, -1 for the uniform ones that only have brickValue */
+    std::vector<int> brickStart;
+    std::vector<float> brickValue;
+    std::vector<float> samples;
+
+    SignedDistanceField();
+    /**
+     * Sample the mesh of a hierarchy at the centers of the cells of its
+     * voxel grid, the sign comes from the grid and the distance from the
+     * closest triangle
+     */
+    void build(const MeshBVH& mesh, const VoxelGrid& voxels, float band);
+    /**
+     * Trilinear signed distance at p, O(1). Points off the field are -band.
+     * The field must have been built or loaded from the fit cache.
+     */
+    float distance(const glm::vec3& p) const;
+    /** Whether the field holds no bricks, neither built nor loaded yet */
+    bool empty() const { return brickStart.empty(); }
+    /** Number of bricks that store their samples */
+    int denseBricks() const;
+};
+
+#endif
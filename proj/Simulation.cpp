@@ -1,4 +1,4 @@
-#include "Sphere.h"
+#include "SphereSystem.h"
 #include "GlobalVariables.h"
 #include "Simulation.h"
 #include <vector>
@@ -6,19 +6,121 @@
 
 using namespace glm;
 
-// Remove spheres if the fall below an Energy threshold
+FixedTimestep::FixedTimestep(float step, int maxSubsteps)
+    : step(step), maxSubsteps(maxSubsteps), accumulator(0.0), last(0.0) {
+}
+
+void FixedTimestep::reset(double now) {
+    accumulator = 0.0;
+    last = now;
+}
+
+int FixedTimestep::advance(double now) {
+    accumulator += now - last;
+    last = now;
+    int steps = (int)(accumulator / step);
+    if (steps > maxSubsteps) {
+        steps = maxSubsteps;
+        accumulator = steps * (double)step;
+    }
+    accumulator -= steps * (double)step;
+    return steps;
+}
+
+float FixedTimestep::alpha() const {
+    return (float)(accumulator / step);
+}
+
+/**
+ * Start the dissolve of model n, placed at position. A complete recording
+ * is played back (the live spheres are dropped), otherwise the dissolve is
+ * simulated live and recorded if nothing else is being recorded. Frames are
+ * recorded every record_interval steps, so only fixed steps are recorded.
+ */
+void startDissolve(int n, vec3 position, float step) {
+    if (baked_playback && dissolveRecording.complete) {
+        dissolvePlayback[n].start(&dissolveRecording);
+        spheres[n]->remove(std::vector<unsigned char>(spheres[n]->size(), 1));
+    }
+    else if (recorder < 0 && !dissolveRecording.complete && !spheres[n]->adaptive) {
+        recorder = n;
+        dissolveRecording.begin(*spheres[n], position, record_interval * step);
+    }
+}
+
+// Record a frame of the live dissolve every record_interval steps, until its spheres are gone
+void recordDissolve(int n) {
+    if (n != recorder || spheres[n]->stepCount % record_interval != 0) return;
+    dissolveRecording.record(*spheres[n]);
+    if (spheres[n]->size() == 0 || dissolveRecording.frames() * dissolveRecording.frameTime > max_record_time) {
+        dissolveRecording.finish();
+        recorder = -1;
+        if (DEBUG_MESSAGES) {
+            std::cout << "Dissolve baked: " << dissolveRecording.frames() << " frames, "
+                << dissolveRecording.data.size() / 1024 << " KB" << std::endl;
+        }
+    }
+}
+
+// Initialize the speed of each sphere depending on its position
+vec3 appendStartingSpeed(vec3 center) {
+    static float x_med = (limits[0][0] + limits[0][1]) / 2.0f;
+    static float z_med = (limits[0][4] + limits[0][5]) / 2.0f;
+    vec3 speed;
+    if (center.x > x_med)
+        speed.x = 0.5f;
+    else
+        speed.x = -0.5f;
+
+    if (center.z > z_med)
+        speed.z = 0.5f;
+    else
+        speed.z = -0.5f;
+
+    speed.y = 1.0f;
+    return speed;
+}
+
+// Add the fitted spheres (center, radius) to the sphere system of every model
+void addSpheres(const std::vector<vec4>& seeds, float mass) {
+    // The snap pushes the spheres away from the vertical axis through the body
+    vec3 axis((limits[0][0] + limits[0][1]) / 2.0f, 0.0f, (limits[0][4] + limits[0][5]) / 2.0f);
+    for (int s = 0; s < N; s++) {
+        spheres[s]->snapImpulse = snap_impulse;
+        spheres[s]->snapCenter = axis;
+        spheres[s]->forces.drag = air_drag;
+        for (int k = 0; k < 3; k++) spheres[s]->forces.wind[k] = wind_velocity[k];
+    }
+    for (int i = 0; i < seeds.size(); i++) {
+        vec3 center(seeds[i]);
+        for (int s = 0; s < N; s++)
+            spheres[s]->add(center, appendStartingSpeed(center), seeds[i].w, mass);
+    }
+}
+
+/**
+ * Remove spheres once they stayed below an Energy threshold for
+ * removal_frames steps. The delay lets the spheres that come to rest on the
+ * floor fall asleep first, as they drop below the threshold long before
+ * they are slow enough to sleep.
+ */
 void removeSpheres() {
+    PhaseTimer timer(physicsStats, PhysicsStats::REMOVE);
+    std::vector<unsigned char> dead;
     for (int i = 0; i < spheres.size(); i++) {
-        auto j = spheres[i].begin();
-        while (j != spheres[i].end()) {
-            float energy = (*j)->x.y * g_earth * (*j)->m + (*j)->calcKinecticEnergy();
-            if (energy < 0.2f) {
-                j = spheres[i].erase(j);
-            }
-            else {
-                ++j;
+        SphereSystem& system = *spheres[i];
+        bool any = false;
+        dead.assign(system.size(), 0);
+        for (int j = 0; j < system.size(); j++) {
+            if (system.energy(j) >= 0.2f) system.settledFrames[j] = 0;
+            else if (system.settledFrames[j] < 0xffff) system.settledFrames[j]++;
+            if (system.settledFrames[j] > removal_frames) {
+                dead[j] = 1;
+                any = true;
+                physicsStats.removed++;
             }
         }
+        if (any) system.remove(dead);
     }
 }
 
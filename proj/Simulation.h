@@ -1,7 +1,9 @@
 #ifndef SIM_H
 #define SIM_H
 
-#include "Sphere.h"
+#include "SphereSystem.h"
+#include "DissolveBake.h"
+#include "PhysicsStats.h"
 #include "BoundingBox.h"
 #include "GlobalVariables.h"
 #include <vector>
@@ -9,12 +11,52 @@
 
 // Global variables in main.cpp used in Simulation.cpp
 extern std::vector<std::vector<BoundingBox*>> bbox;
-extern std::vector<std::vector<Sphere*>> spheres;
+extern std::vector<SphereSystem*> spheres;
+extern float limits[5][6];
 extern bool sim[N];
 extern bool dispersion[N];
+extern DissolveRecording dissolveRecording;
+extern DissolvePlayback dissolvePlayback[N];
+extern int recorder;
+extern bool baked_playback;
+extern int record_interval;
+extern float max_record_time;
+extern PhysicsStats physicsStats;
+extern int removal_frames;
+extern float snap_impulse;
+extern float air_drag;
+extern glm::vec3 wind_velocity;
+
+/**
+ * Fixed timestep accumulator. The time that passes between frames is
+ * consumed in steps of constant size, so the simulation runs at the same
+ * pace whatever the frame rate. At most maxSubsteps steps are taken per
+ * frame, the rest of the time is dropped (the simulation slows down instead
+ * of spiralling when a step costs more than it simulates).
+ */
+class FixedTimestep {
+public:
+    float step;
+    int maxSubsteps;
+    /** simulated time not consumed by a step yet */
+    double accumulator;
+    /** time of the last call */
+    double last;
+
+    FixedTimestep(float step, int maxSubsteps);
+    /** Restart counting from now, without taking steps */
+    void reset(double now);
+    /** Add the time since the last call and return the number of steps to take */
+    int advance(double now);
+    /** How far between the previous and the current step the frame is, in [0, 1] */
+    float alpha() const;
+};
 
 // Function Prototypes
 void checkSim(glm::vec3 position, float h_angle, float v_angle);
+void addSpheres(const std::vector<glm::vec4>& seeds, float mass);
 void removeSpheres();
+void startDissolve(int n, glm::vec3 position, float step);
+void recordDissolve(int n);
 
 #endif
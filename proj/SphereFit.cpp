@@ -1,9 +1,6 @@
-#include "Collision.h"
-#include "Box.h"
-#include "Sphere.h"
 #include "SphereFit.h"
-#include "common/model.h"
 #include <omp.h>
+#include <algorithm>
 #include <iostream>
 
 using namespace glm;
@@ -13,7 +10,7 @@ using namespace glm;
  * The y-levels used were manually selected via 
  * trial and error and are specific for this model.
  */
-void createLimitsArray() {
+void createLimitsArray(const std::vector<vec3>& vertices) {
     // initialize limits with big numbers
     for (int i = 0; i < 5; i++) {
         for (int j = 0; j < 6; j++) {
@@ -24,179 +21,231 @@ void createLimitsArray() {
         }
     }
 
-    for (int i = 0; i < models[0]->vertices.size(); i++) {
-        if (models[0]->vertices[i].y > 1.0f) {
-            if (models[0]->vertices[i].x < limits[0][0]) limits[0][0] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].x > limits[0][1]) limits[0][1] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].y < limits[0][2]) limits[0][2] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].y > limits[0][3]) limits[0][3] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].z < limits[0][4]) limits[0][4] = models[0]->vertices[i].z;
-            if (models[0]->vertices[i].z > limits[0][5]) limits[0][5] = models[0]->vertices[i].z;
+    for (int i = 0; i < vertices.size(); i++) {
+        if (vertices[i].y > 1.0f) {
+            if (vertices[i].x < limits[0][0]) limits[0][0] = vertices[i].x;
+            if (vertices[i].x > limits[0][1]) limits[0][1] = vertices[i].x;
+            if (vertices[i].y < limits[0][2]) limits[0][2] = vertices[i].y;
+            if (vertices[i].y > limits[0][3]) limits[0][3] = vertices[i].y;
+            if (vertices[i].z < limits[0][4]) limits[0][4] = vertices[i].z;
+            if (vertices[i].z > limits[0][5]) limits[0][5] = vertices[i].z;
         }
-        else if (models[0]->vertices[i].y > 0.5f) {
-            if (models[0]->vertices[i].x < limits[1][0]) limits[1][0] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].x > limits[1][1]) limits[1][1] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].y < limits[1][2]) limits[1][2] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].y > limits[1][3]) limits[1][3] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].z < limits[1][4]) limits[1][4] = models[0]->vertices[i].z;
-            if (models[0]->vertices[i].z > limits[1][5]) limits[1][5] = models[0]->vertices[i].z;
+        else if (vertices[i].y > 0.5f) {
+            if (vertices[i].x < limits[1][0]) limits[1][0] = vertices[i].x;
+            if (vertices[i].x > limits[1][1]) limits[1][1] = vertices[i].x;
+            if (vertices[i].y < limits[1][2]) limits[1][2] = vertices[i].y;
+            if (vertices[i].y > limits[1][3]) limits[1][3] = vertices[i].y;
+            if (vertices[i].z < limits[1][4]) limits[1][4] = vertices[i].z;
+            if (vertices[i].z > limits[1][5]) limits[1][5] = vertices[i].z;
         }
-        else if (models[0]->vertices[i].y > -0.2f) {
-            if (models[0]->vertices[i].x < limits[2][0]) limits[2][0] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].x > limits[2][1]) limits[2][1] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].y < limits[2][2]) limits[2][2] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].y > limits[2][3]) limits[2][3] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].z < limits[2][4]) limits[2][4] = models[0]->vertices[i].z;
-            if (models[0]->vertices[i].z > limits[2][5]) limits[2][5] = models[0]->vertices[i].z;
+        else if (vertices[i].y > -0.2f) {
+            if (vertices[i].x < limits[2][0]) limits[2][0] = vertices[i].x;
+            if (vertices[i].x > limits[2][1]) limits[2][1] = vertices[i].x;
+            if (vertices[i].y < limits[2][2]) limits[2][2] = vertices[i].y;
+            if (vertices[i].y > limits[2][3]) limits[2][3] = vertices[i].y;
+            if (vertices[i].z < limits[2][4]) limits[2][4] = vertices[i].z;
+            if (vertices[i].z > limits[2][5]) limits[2][5] = vertices[i].z;
         }
-        else if (models[0]->vertices[i].y > -1.4f) {
-            if (models[0]->vertices[i].x < limits[3][0]) limits[3][0] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].x > limits[3][1]) limits[3][1] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].y < limits[3][2]) limits[3][2] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].y > limits[3][3]) limits[3][3] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].z < limits[3][4]) limits[3][4] = models[0]->vertices[i].z;
-            if (models[0]->vertices[i].z > limits[3][5]) limits[3][5] = models[0]->vertices[i].z;
+        else if (vertices[i].y > -1.4f) {
+            if (vertices[i].x < limits[3][0]) limits[3][0] = vertices[i].x;
+            if (vertices[i].x > limits[3][1]) limits[3][1] = vertices[i].x;
+            if (vertices[i].y < limits[3][2]) limits[3][2] = vertices[i].y;
+            if (vertices[i].y > limits[3][3]) limits[3][3] = vertices[i].y;
+            if (vertices[i].z < limits[3][4]) limits[3][4] = vertices[i].z;
+            if (vertices[i].z > limits[3][5]) limits[3][5] = vertices[i].z;
         }
         else {
-            if (models[0]->vertices[i].x < limits[4][0]) limits[4][0] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].x > limits[4][1]) limits[4][1] = models[0]->vertices[i].x;
-            if (models[0]->vertices[i].y < limits[4][2]) limits[4][2] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].y > limits[4][3]) limits[4][3] = models[0]->vertices[i].y;
-            if (models[0]->vertices[i].z < limits[4][4]) limits[4][4] = models[0]->vertices[i].z;
-            if (models[0]->vertices[i].z > limits[4][5]) limits[4][5] = models[0]->vertices[i].z;
+            if (vertices[i].x < limits[4][0]) limits[4][0] = vertices[i].x;
+            if (vertices[i].x > limits[4][1]) limits[4][1] = vertices[i].x;
+            if (vertices[i].y < limits[4][2]) limits[4][2] = vertices[i].y;
+            if (vertices[i].y > limits[4][3]) limits[4][3] = vertices[i].y;
+            if (vertices[i].z < limits[4][4]) limits[4][4] = vertices[i].z;
+            if (vertices[i].z > limits[4][5]) limits[4][5] = vertices[i].z;
         }
     }
 }
 
 /**
- * A MollerTrumbore ray-triangle intersection algorithm implementation
- * taken by http://www.lighthouse3d.com/tutorials/maths/ray-triangle-intersection/
+ * The triangles of a triangle soup with a vertex strictly between the
+ * y-levels yMin and yMax, the model vertices of the bounding box of a slab
  */
-bool MollerTrumbore(vec3 point, vec3 v0, vec3 v1, vec3 v2) {
-    const float epsilon = 0.0000001;
-    vec3 edge1, edge2, h, s, q;
-    float a, f, u, v;
-    vec3 rayDir = vec3(0.0f, 0.0f, 1.0f);
-
-    edge1 = v1 - v0;
-    edge2 = v2 - v0;
-    h = cross(rayDir, edge2);
-    a = dot(edge1, h);
-    if (a > -epsilon && a < epsilon)
-        return false;
-
-    f = 1.0f / a;
-    s = point - v0;
-    u = f * dot(s, h);
-    if (u < 0.0f || u > 1.0f)
-        return false;
-
-    q = cross(s, edge1);
-    v = f * dot(rayDir, q);
-    if (v < 0.0f || u + v > 1.0f)
-        return false;
-
-    float t = f * dot(edge2, q);
-    if (t > epsilon)
-        return true;
-    else
-        return false;
+void sliceTriangles(const std::vector<vec3>& vertices, float yMin, float yMax, std::vector<vec3>& slice) {
+    slice.clear();
+    for (int i = 0; i < vertices.size(); i += 3) {
+        bool add = false;
+        for (int k = 0; k < 3; k++)
+            add = add || (vertices[i + k].y > yMin && vertices[i + k].y < yMax);
+        if (add) {
+            slice.push_back(vertices[i]);
+            slice.push_back(vertices[i + 1]);
+            slice.push_back(vertices[i + 2]);
+        }
+    }
 }
 
 /**
- * Decide if a point is inside the model using ray - tringle intersection
- * with every triangle in the same bounding box. The algorithm used for the 
- * ray - triangle intersection is the MollerTrumbore algorithm.
+ * Voxelize the body in cells of the given side, one ray per column through
+ * its hierarchy. The inside tests of the fitting and the billboard map
+ * read the grid.
  */
-bool point_inside(vec3 point, int bboxID) {
-    int intersect = 0;
-    for (int i = 0; i < bbox[0][bboxID]->vertices.size(); i += 3) {
-        if (MollerTrumbore(point, bbox[0][bboxID]->vertices[i], bbox[0][bboxID]->vertices[i + 1], bbox[0][bboxID]->vertices[i + 2]))
-            intersect++;
-    }
-    if (intersect % 2 == 0) return false;
-    else return true;
+void createVoxelGrid(float cellSize) {
+    bodyVoxels.build(*bodyBVH, cellSize);
 }
 
 /**
- * Create six boundary points of a sphere and check if each one of them
- * is inside the model. This function uses OpenMP to accelerate the process
+ * Sample the signed distance to the body at the centers of the voxels,
+ * exact up to band (it must exceed the largest sphere radius)
  */
-bool sphere_inside(vec3 center, float rad,int bboxID) {
-    vec3 up = center + vec3(0.0f, rad, 0.0f);
-    vec3 down = center + vec3(0.0f, -rad, 0.0f);
-    vec3 front = center + vec3(0.0f, 0.0f, rad);
-    vec3 back = center + vec3(0.0f, 0.0f, -rad);
-    vec3 right = center + vec3(rad, 0.0f, 0.0f);
-    vec3 left = center + vec3(-rad, 0.0f, 0.0f);
-    vec3 points[6] = { up, down, front, back, right, left };
-    
-    bool inside = true;
-    #pragma omp parallel for reduction(&&:inside)
-    for (int i = 0; i < 6; i++) {
-        bool temp = point_inside(points[i], bboxID);
-        inside = inside && temp;
-    }
-    return inside;
+void createDistanceField(float band) {
+    bodySDF.build(*bodyBVH, bodyVoxels, band);
 }
 
-// Initialize the speed of each sphere depending on its position
-vec3 appendStartingSpeed(vec3 center) {
-    static float x_med = (limits[0][0] + limits[0][1]) / 2.0f;
-    static float z_med = (limits[0][4] + limits[0][5]) / 2.0f;
-    vec3 speed;
-    if (center.x > x_med)
-        speed.x = 0.5f;
-    else
-        speed.x = -0.5f;
-
-    if (center.z > z_med)
-        speed.z = 0.5f;
-    else
-        speed.z = -0.5f;
-
-    speed.y = 1.0f;
-    return speed;
+/**
+ * Decide if a point is inside the model, from the cell of the voxel grid
+ * it falls in. The cells were filled by the parity of the ray - triangle
+ * intersections along their column.
+ */
+bool point_inside(vec3 point) {
+    return bodyVoxels.inside(point);
+}
+
+/**
+ * A sphere fits in the model if its center is at least its radius deep,
+ * which also holds in the concave parts that testing points on the sphere
+ * misses. One lookup of the distance field.
+ */
+bool sphere_inside(vec3 center, float rad) {
+    return bodySDF.distance(center) >= rad;
 }
 
 /**
  * Traverse the bounding boxes in cubes of size equal to step/100 and 
  * check if the sphere of the radious given and with the same center as the cube
- * is inside the model. If so, create the sphere and push it in the spheres vector.
+ * is inside the model. If so, append the sphere (center, radius) to seeds.
+ * The cells of a box are tested in parallel, each one writes the radius it
+ * fits in its own slot, and the spheres are appended in the order of the cells
+ * so that they are the same whatever the number of threads.
  */
-void createSpheres(int step, float *rad, float mass) {
+void createSpheres(int step, const float *rad, std::vector<vec4>& seeds) {
     float halfstep = 0.01f * step * 0.5f;
+    std::vector<signed char> fit;
     for (int i = 0; i < 5; i++) {
-        float rangex = bbox[0][i]->limits[1] - bbox[0][i]->limits[0];
-        float rangey = bbox[0][i]->limits[3] - bbox[0][i]->limits[2];
-        float rangez = bbox[0][i]->limits[5] - bbox[0][i]->limits[4];
-        for (int j = 0; j < (int)(rangex * 100.0f) - step; j += step) {
-            for (int k = 0; k < (int)(rangey * 100.0f) - step; k += step) {
-                for (int l = 0; l < (int)(rangez * 100.0f) - step; l += step) {
-                    vec3 bot_left_back = vec3(bbox[0][i]->limits[0] + 0.01f * j, bbox[0][i]->limits[2] + 0.01f * k, bbox[0][i]->limits[4] + 0.01f * l);
-                    vec3 center = bot_left_back + vec3(halfstep, halfstep, halfstep);
-                    if (sphere_inside(center, rad[0], i)) {
-                        for (int s = 0; s < N; s++) {
-                            spheres[s].push_back(new Sphere(center, appendStartingSpeed(center), rad[0], mass));
-                            spheresStartingHeight[s].push_back(center.y);
-                        }
-                    }
-                    else if (sphere_inside(center, rad[1], i)) {
-                        for (int s = 0; s < N; s++) {
-                            spheres[s].push_back(new Sphere(center, appendStartingSpeed(center), rad[1], mass));
-                            spheresStartingHeight[s].push_back(center.y);
-                        }
-                    }
-                    else if (sphere_inside(center, rad[2], i)) {
-                        for (int s = 0; s < N; s++) {
-                            spheres[s].push_back(new Sphere(center, appendStartingSpeed(center), rad[2], mass));
-                            spheresStartingHeight[s].push_back(center.y);
-                        }
-                    }
+        float rangex = limits[i][1] - limits[i][0];
+        float rangey = limits[i][3] - limits[i][2];
+        float rangez = limits[i][5] - limits[i][4];
+        // cells per axis, as the loops j, k, l of step over the ranges
+        int nx = std::max(0, ((int)(rangex * 100.0f) - step + step - 1) / step);
+        int ny = std::max(0, ((int)(rangey * 100.0f) - step + step - 1) / step);
+        int nz = std::max(0, ((int)(rangez * 100.0f) - step + step - 1) / step);
+        int cells = nx * ny * nz;
+        fit.assign(cells, -1);
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int c = 0; c < cells; c++) {
+            int j = (c / (ny * nz)) * step, k = ((c / nz) % ny) * step, l = (c % nz) * step;
+            vec3 bot_left_back = vec3(limits[i][0] + 0.01f * j, limits[i][2] + 0.01f * k, limits[i][4] + 0.01f * l);
+            vec3 center = bot_left_back + vec3(halfstep, halfstep, halfstep);
+            for (int r = 0; r < 3; r++) {
+                if (sphere_inside(center, rad[r])) {
+                    fit[c] = r;
+                    break;
                 }
             }
         }
+
+        for (int c = 0; c < cells; c++) {
+            if (fit[c] < 0) continue;
+            int j = (c / (ny * nz)) * step, k = ((c / nz) % ny) * step, l = (c % nz) * step;
+            vec3 bot_left_back = vec3(limits[i][0] + 0.01f * j, limits[i][2] + 0.01f * k, limits[i][4] + 0.01f * l);
+            vec3 center = bot_left_back + vec3(halfstep, halfstep, halfstep);
+            seeds.push_back(vec4(center, rad[fit[c]]));
+        }
+    }
+}
+
+// A cell of the octree packing: lower corner and the sphere it takes, w = 0 for none
+struct PackCell {
+    vec3 corner;
+    vec4 sphere;
+};
+
+/**
+ * Adaptive octree packing over the bounds of the voxel grid. Every level
+ * halves the cells still worth refining. A cell gets the largest sphere
+ * its center allows (the distance field depth, at most half its side and
+ * maxRadius) once that sphere nearly fills it, or at the last level
+ * (cells 2 * minRadius wide) if it is at least minRadius. Deep volumes end
+ * up with a few large spheres and thin parts with small ones, none of them
+ * overlapping since each stays in its cell. The distance field band must
+ * reach maxRadius.
+ *
+ * With a budget (0: no limit) a cell is only refined while the spheres
+ * placed so far, the children and the fallback spheres of the cells still
+ * to refine (what they hold if they stop, when it is at least minRadius)
+ * stay within it. The cells of a level are refined worst covered first,
+ * so the budget is spread over the whole body instead of running out
+ * before its thin parts.
+ */
+void packSpheres(float minRadius, float maxRadius, int budget, std::vector<vec4>& seeds) {
+    // a sphere that fills this much of its cell is not refined any more
+    const float fill = 0.9f;
+    const vec3 corners[8] = {
+        vec3(0, 0, 0), vec3(1, 0, 0), vec3(0, 1, 0), vec3(1, 1, 0),
+        vec3(0, 0, 1), vec3(1, 0, 1), vec3(0, 1, 1), vec3(1, 1, 1) };
+    vec3 extent = vec3(bodyVoxels.dims[0], bodyVoxels.dims[1], bodyVoxels.dims[2]) * bodyVoxels.cellSize;
+    float side = std::max(extent.x, std::max(extent.y, extent.z));
+    int maxDepth = 0;
+    for (float half = 0.5f * side; 0.5f * half >= minRadius; half *= 0.5f) maxDepth++;
+
+    // Sorts a cell of the given half side into the placed spheres or the
+    // cells to refine, returns the number of spheres it holds if it stops
+    std::vector<vec4> placed;
+    std::vector<PackCell> cells, next;
+    auto classify = [&](const vec3& corner, float half, bool last, std::vector<vec4>& spheres,
+                        std::vector<PackCell>& refine) -> int {
+        vec3 center = corner + vec3(half);
+        float depth = bodySDF.distance(center);
+        // the cell is entirely outside
+        if (depth <= -half * std::sqrt(3.0f)) return 0;
+        float r = std::min(depth, std::min(half, maxRadius));
+        if (r >= fill * half || (last && r >= minRadius)) {
+            spheres.push_back(vec4(center, r));
+            return 1;
+        }
+        if (last) return 0;
+        PackCell cell = { corner, vec4(center, r >= minRadius ? r : 0.0f) };
+        refine.push_back(cell);
+        return cell.sphere.w > 0.0f;
+    };
+
+    int total = classify(bodyVoxels.lo, 0.5f * side, maxDepth == 0, placed, cells);
+    std::vector<vec4> childSpheres;
+    std::vector<PackCell> childCells;
+    for (int level = 0; !cells.empty(); level++, side *= 0.5f) {
+        float half = 0.5f * side;
+        // the worst covered cells first, the ones without a sphere before all
+        std::stable_sort(cells.begin(), cells.end(), [](const PackCell& a, const PackCell& b) {
+            return a.sphere.w < b.sphere.w;
+        });
+        next.clear();
+        for (int c = 0; c < cells.size(); c++) {
+            childSpheres.clear();
+            childCells.clear();
+            int hold = 0;
+            for (int k = 0; k < 8; k++)
+                hold += classify(cells[c].corner + corners[k] * half, 0.5f * half, level + 1 == maxDepth,
+                                 childSpheres, childCells);
+            int delta = hold - (cells[c].sphere.w > 0.0f);
+            if (budget <= 0 || total + delta <= budget) {
+                total += delta;
+                placed.insert(placed.end(), childSpheres.begin(), childSpheres.end());
+                next.insert(next.end(), childCells.begin(), childCells.end());
+            }
+            else if (cells[c].sphere.w > 0.0f) placed.push_back(cells[c].sphere);
+        }
+        cells.swap(next);
     }
+    seeds.insert(seeds.end(), placed.begin(), placed.end());
 }
 
 // Create a billboard map to use for the billboard generator
@@ -205,18 +254,24 @@ void createBillboardMap(float bboard_size) {
     float halfstep = 0.01f * step * 0.5f;
     for (int i = 0; i < 5; i++) {
         // Cut the model in half
-        float z = (bbox[0][i]->limits[5] + bbox[0][i]->limits[4]) / 2;
-        float rangex = bbox[0][i]->limits[1] - bbox[0][i]->limits[0];
-        float rangey = bbox[0][i]->limits[3] - bbox[0][i]->limits[2];
-        for (int j = 0; j < (int)(rangey * 100.0f); j += step) {
-            b_levels.push_back(bbox[0][i]->limits[3] - 0.01f * j);
-            for (int k = 0; k < (int)(rangex * 100.0f); k += step) {
-                vec3 center = vec3(bbox[0][i]->limits[0] + 0.01f * k, bbox[0][i]->limits[3] - 0.01f * j, z) + vec3(halfstep, -halfstep, 0);
-                if (point_inside(center, i))
-                    billboardMap[i].push_back(true);
-                else
-                    billboardMap[i].push_back(false);
-            }
+        float z = (limits[i][5] + limits[i][4]) / 2;
+        float rangex = limits[i][1] - limits[i][0];
+        float rangey = limits[i][3] - limits[i][2];
+        int rows = ((int)(rangey * 100.0f) + step - 1) / step;
+        int cols = ((int)(rangex * 100.0f) + step - 1) / step;
+        for (int j = 0; j < rows; j++)
+            b_levels.push_back(limits[i][3] - 0.01f * (j * step));
+
+        // The cells are tested in parallel into their own slots, then
+        // appended row by row (std::vector<bool> can not be written in parallel)
+        std::vector<unsigned char> inside(rows * cols);
+        #pragma omp parallel for
+        for (int c = 0; c < rows * cols; c++) {
+            int j = (c / cols) * step, k = (c % cols) * step;
+            vec3 center = vec3(limits[i][0] + 0.01f * k, limits[i][3] - 0.01f * j, z) + vec3(halfstep, -halfstep, 0);
+            inside[c] = point_inside(center);
         }
+        for (int c = 0; c < rows * cols; c++)
+            billboardMap[i].push_back(inside[c] != 0);
     }
 }
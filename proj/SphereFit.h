@@ -1,23 +1,27 @@
 #ifndef SPHERE_FIT_H
 #define SPHERE_FIT_H
 
-#include "Sphere.h"
-#include "BoundingBox.h"
+#include "MeshBVH.h"
+#include "VoxelGrid.h"
+#include "SignedDistanceField.h"
 #include "GlobalVariables.h"
 #include <vector>
 #include <glm/glm.hpp>
-// Global variables in main.cpp used in SphereFit.cpp
-extern std::vector<std::vector<BoundingBox*>> bbox;
+// Global variables in main.cpp (or the bake tool) used in SphereFit.cpp
 extern float limits[5][6];
-extern std::vector<Drawable*> models;
-extern std::vector<std::vector<Sphere*>> spheres;
-extern std::vector<std::vector<float>> spheresStartingHeight;
 extern std::vector<std::vector<bool>> billboardMap;
 extern std::vector<float> b_levels;
+extern MeshBVH* bodyBVH;
+extern VoxelGrid bodyVoxels;
+extern SignedDistanceField bodySDF;
 
 // Function Prototypes
-void createLimitsArray();
+void createLimitsArray(const std::vector<glm::vec3>& vertices);
+void sliceTriangles(const std::vector<glm::vec3>& vertices, float yMin, float yMax, std::vector<glm::vec3>& slice);
+void createVoxelGrid(float cellSize);
+void createDistanceField(float band);
 void createBillboardMap(float bboard_size);
-void createSpheres(int step, float *rad, float mass);
+void createSpheres(int step, const float *rad, std::vector<glm::vec4>& seeds);
+void packSpheres(float minRadius, float maxRadius, int budget, std::vector<glm::vec4>& seeds);
 
 #endif
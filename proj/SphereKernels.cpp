@@ -0,0 +1,252 @@
+#include "RigidBody.h"
+#include "SphereKernelsImpl.h"
+#include "GlobalVariables.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#ifdef SPHERE_KERNELS_X86
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#endif
+
+using namespace glm;
+
+ForceField::ForceField() {
+    gravity[0] = 0.0f;
+    gravity[1] = -g_earth;
+    gravity[2] = 0.0f;
+    drag = 0.0f;
+    wind[0] = wind[1] = wind[2] = 0.0f;
+}
+
+void ForceField::force(float m, const float* P, float* f) const {
+    for (int k = 0; k < 3; k++)
+        f[k] = m * gravity[k] + drag * wind[k] - drag * (P[k] / m);
+}
+
+void rk4Scalar(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceLanes<ScalarOps, RK4Scheme>(s, forces, begin, end, h);
+}
+
+void eulerScalar(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceLanes<ScalarOps, EulerScheme>(s, forces, begin, end, h);
+}
+
+void verletScalar(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceLanes<ScalarOps, VerletScheme>(s, forces, begin, end, h);
+}
+
+#ifdef SPHERE_KERNELS_X86
+namespace {
+
+// Lane operations for 4 spheres at a time (SSE2 is always present on x86-64)
+struct SSEOps {
+    typedef __m128 T;
+    typedef __m128 M;
+    static const int WIDTH = 4;
+    static inline T load(const float* p) { return _mm_loadu_ps(p); }
+    static inline void store(float* p, T a) { _mm_storeu_ps(p, a); }
+    static inline T set(float a) { return _mm_set1_ps(a); }
+    static inline T add(T a, T b) { return _mm_add_ps(a, b); }
+    static inline T sub(T a, T b) { return _mm_sub_ps(a, b); }
+    static inline T mul(T a, T b) { return _mm_mul_ps(a, b); }
+    static inline T div(T a, T b) { return _mm_div_ps(a, b); }
+    static inline T sqrt(T a) { return _mm_sqrt_ps(a); }
+    static inline M mask(const unsigned char* awake) {
+        __m128i flags = _mm_set_epi32(awake[3], awake[2], awake[1], awake[0]);
+        return _mm_castsi128_ps(_mm_cmpgt_epi32(flags, _mm_setzero_si128()));
+    }
+    static inline bool any(M m) { return _mm_movemask_ps(m) != 0; }
+    static inline T select(M m, T a, T b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+};
+
+}
+
+void rk4SSE(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceSpheres<SSEOps, RK4Scheme>(s, forces, begin, end, h);
+}
+
+void eulerSSE(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceSpheres<SSEOps, EulerScheme>(s, forces, begin, end, h);
+}
+
+void verletSSE(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceSpheres<SSEOps, VerletScheme>(s, forces, begin, end, h);
+}
+
+// Check for AVX2 support by both the CPU and the OS
+static bool cpuHasAVX2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+// Kernels of each integrator, indexed by Integrator
+static const SphereKernel scalarKernels[INTEGRATORS] = { rk4Scalar, eulerScalar, verletScalar };
+#ifdef SPHERE_KERNELS_X86
+static const SphereKernel sseKernels[INTEGRATORS] = { rk4SSE, eulerSSE, verletSSE };
+static const SphereKernel avx2Kernels[INTEGRATORS] = { rk4AVX2, eulerAVX2, verletAVX2 };
+#endif
+
+SphereKernel selectSphereKernel(Integrator integrator) {
+#ifdef SPHERE_KERNELS_X86
+    static bool avx2 = cpuHasAVX2();
+    return avx2 ? avx2Kernels[integrator] : sseKernels[integrator];
+#else
+    return scalarKernels[integrator];
+#endif
+}
+
+const char* sphereKernelName(SphereKernel kernel) {
+#ifdef SPHERE_KERNELS_X86
+    for (int n = 0; n < INTEGRATORS; n++) {
+        if (kernel == avx2Kernels[n]) return "AVX2";
+        if (kernel == sseKernels[n]) return "SSE";
+    }
+#endif
+    return "scalar";
+}
+
+const char* integratorName(Integrator integrator) {
+    switch (integrator) {
+    case RK4: return "RK4";
+    case SEMI_IMPLICIT_EULER: return "semi-implicit Euler";
+    case VELOCITY_VERLET: return "velocity Verlet";
+    default: return "unknown";
+    }
+}
+
+int integratorOrder(Integrator integrator) {
+    switch (integrator) {
+    case RK4: return 4;
+    case VELOCITY_VERLET: return 2;
+    default: return 1;
+    }
+}
+
+// Advance the states with a kernel, the same way SphereSystem does
+static void runKernel(SphereKernel kernel, const ForceField& forces, const std::vector<RigidBody::State>& initial,
+                      std::vector<float>& mass, std::vector<float>& I_inv, std::vector<unsigned char>& released,
+                      int steps, float h, std::vector<RigidBody::State>& result) {
+    int count = (int)initial.size();
+    std::vector<float> y[RigidBody::STATES];
+    for (int k = 0; k < RigidBody::STATES; k++) {
+        y[k].resize(count);
+        for (int i = 0; i < count; i++) y[k][i] = initial[i][k];
+    }
+    SphereStates s = {
+        { &y[0][0], &y[1][0], &y[2][0] },
+        { &y[3][0], &y[4][0], &y[5][0], &y[6][0] },
+        { &y[7][0], &y[8][0], &y[9][0] },
+        { &y[10][0], &y[11][0], &y[12][0] },
+        &mass[0], &I_inv[0], &released[0] };
+    // the reference normalizes q when the state is set
+    for (int i = 0; i < count; i++) {
+        if (!released[i]) continue;
+        quat qn = normalize(quat(y[6][i], y[3][i], y[4][i], y[5][i]));
+        y[3][i] = qn.x;
+        y[4][i] = qn.y;
+        y[5][i] = qn.z;
+        y[6][i] = qn.w;
+    }
+    for (int step = 0; step < steps; step++) kernel(s, forces, 0, count, h);
+
+    result.resize(count);
+    for (int i = 0; i < count; i++)
+        for (int k = 0; k < RigidBody::STATES; k++) result[i][k] = y[k][i];
+}
+
+bool verifySphereKernels(float tolerance) {
+    const int count = 37;   // not a multiple of the lane widths, to cover the tails
+    const int steps = 100;
+    const float h = 0.004f;
+
+    // Gravity, drag and wind
+    ForceField forces;
+    forces.drag = 0.05f;
+    forces.wind[0] = 1.0f;
+    forces.wind[2] = -0.5f;
+
+    // Random states, every third sphere is not released
+    std::vector<RigidBody::State> initial(count);
+    std::vector<float> mass(count), radius(count), I_inv(count);
+    std::vector<unsigned char> released(count);
+    srand(7);
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < RigidBody::STATES; k++)
+            initial[i][k] = rand() / (float)RAND_MAX - 0.5f;
+        for (int k = 10; k < 13; k++)
+            initial[i][k] *= 0.001f;
+        mass[i] = 0.3f;
+        radius[i] = 0.015f + 0.015f * rand() / (float)RAND_MAX;
+        I_inv[i] = 1.0f / (2.0f / 5 * mass[i] * radius[i] * radius[i]);
+        released[i] = i % 3 != 0;
+    }
+
+    bool passed = true;
+    for (int integrator = 0; integrator < INTEGRATORS; integrator++) {
+        std::vector<SphereKernel> kernels;
+        std::vector<RigidBody::State> reference(initial);
+        if (integrator == RK4) {
+            // RK4 is checked against RigidBody
+            kernels.push_back(rk4Scalar);
+            for (int i = 0; i < count; i++) {
+                if (!released[i]) continue;
+                RigidBody body;
+                body.m = mass[i];
+                body.setInertia(1.0f / I_inv[i]);
+                // the forcing function is the slow path for the same force field
+                body.forcing = [&body, &forces](float t, const RigidBody::State& y)->std::vector<float> {
+                    std::vector<float> f(6, 0.0f);
+                    forces.force(body.m, &y[RigidBody::STATES - 6], &f[0]);
+                    return f;
+                };
+                body.setY(reference[i]);
+                for (int n = 0; n < steps; n++) body.advanceState(n * h, h);
+                reference[i] = body.getY();
+            }
+        }
+        else {
+            // the other integrators against their scalar kernel
+            runKernel(scalarKernels[integrator], forces, initial, mass, I_inv, released, steps, h, reference);
+        }
+#ifdef SPHERE_KERNELS_X86
+        kernels.push_back(sseKernels[integrator]);
+        if (cpuHasAVX2()) kernels.push_back(avx2Kernels[integrator]);
+#endif
+
+        for (int n = 0; n < kernels.size(); n++) {
+            std::vector<RigidBody::State> result;
+            runKernel(kernels[n], forces, initial, mass, I_inv, released, steps, h, result);
+
+            float maxError = 0.0f;
+            for (int i = 0; i < count; i++) {
+                for (int k = 0; k < RigidBody::STATES; k++) {
+                    float expected = released[i] ? reference[i][k] : initial[i][k];
+                    maxError = std::max(maxError, std::abs(result[i][k] - expected));
+                }
+            }
+            bool ok = maxError <= tolerance;
+            passed = passed && ok;
+            std::cout << integratorName((Integrator)integrator) << " " << sphereKernelName(kernels[n])
+                << " kernel max error: " << maxError << (ok ? "" : " (FAILED)") << std::endl;
+        }
+    }
+    return passed;
+}
@@ -0,0 +1,91 @@
+#ifndef SPHERE_KERNELS_H
+#define SPHERE_KERNELS_H
+
+// The SSE/AVX2 kernels are only built for 64-bit x86, other targets use
+// the scalar kernel
+#if defined(__x86_64__) || defined(_M_X64)
+#define SPHERE_KERNELS_X86
+#endif
+
+/**
+ * Structure-of-arrays view of the sphere states advanced by the kernels,
+ * laid out per component as RigidBody::State [x, q, P, L]
+ */
+struct SphereStates {
+    float* x[3];
+    float* q[4];
+    float* P[3];
+    float* L[3];
+    const float* m;
+    const float* I_inv;
+    /** only the awake spheres (released and not sleeping) are advanced */
+    const unsigned char* awake;
+};
+
+/**
+ * Force field shared by every sphere of a system and inlined by the
+ * kernels. The force on a sphere of mass m and velocity v is
+ * F = m * gravity + drag * (wind - v), with no torque.
+ */
+struct ForceField {
+    /** gravitational acceleration */
+    float gravity[3];
+    /** linear drag coefficient, 0 disables drag */
+    float drag;
+    /** velocity of the air the drag is relative to */
+    float wind[3];
+
+    ForceField();
+    /** Force on a sphere [fx, fy, fz], the scalar version of the kernels' force */
+    void force(float m, const float* P, float* f) const;
+};
+
+/** Integration schemes a sphere system can be advanced with */
+enum Integrator {
+    /** Runge-Kutta 4th order, 4 derivatives per step */
+    RK4,
+    /** semi-implicit (symplectic) Euler, 1 force evaluation per step */
+    SEMI_IMPLICIT_EULER,
+    /** velocity Verlet (kick - drift - kick), 2 force evaluations per step */
+    VELOCITY_VERLET,
+    INTEGRATORS
+};
+
+/**
+ * A kernel advances the spheres [begin, end) from t to t + h under the force
+ * field with one of the integration schemes
+ */
+typedef void (*SphereKernel)(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+
+/** The same scheme as RigidBody::rungeKuta4th */
+void rk4Scalar(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+void eulerScalar(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+void verletScalar(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+#ifdef SPHERE_KERNELS_X86
+/** 4 spheres per instruction */
+void rk4SSE(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+void eulerSSE(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+void verletSSE(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+/** 8 spheres per instruction, built in its own translation unit with AVX2 enabled */
+void rk4AVX2(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+void eulerAVX2(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+void verletAVX2(const SphereStates& s, const ForceField& forces, int begin, int end, float h);
+#endif
+
+/** Select the widest kernel of the integrator supported by the CPU we are running on */
+SphereKernel selectSphereKernel(Integrator integrator = RK4);
+/** Human readable name of the instruction set of a kernel */
+const char* sphereKernelName(SphereKernel kernel);
+/** Human readable name of an integrator */
+const char* integratorName(Integrator integrator);
+/** Order of accuracy of an integrator, the local error shrinks as h^(order + 1) */
+int integratorOrder(Integrator integrator);
+/**
+ * Advance a set of random sphere states with every kernel available on
+ * this CPU, compare the RK4 kernels with RigidBody::rungeKuta4th and the
+ * rest with the scalar kernel of their integrator, print the largest
+ * difference per kernel and return false if one exceeds the tolerance
+ */
+bool verifySphereKernels(float tolerance = 1e-4f);
+
+#endif
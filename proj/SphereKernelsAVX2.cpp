@@ -0,0 +1,44 @@
+#include "SphereKernelsImpl.h"
+
+// This translation unit is compiled with AVX2 enabled (see CMakeLists.txt),
+// its kernels must only be called after selectSphereKernel checked the CPU
+#ifdef SPHERE_KERNELS_X86
+#include <immintrin.h>
+
+namespace {
+
+// Lane operations for 8 spheres at a time
+struct AVX2Ops {
+    typedef __m256 T;
+    typedef __m256 M;
+    static const int WIDTH = 8;
+    static inline T load(const float* p) { return _mm256_loadu_ps(p); }
+    static inline void store(float* p, T a) { _mm256_storeu_ps(p, a); }
+    static inline T set(float a) { return _mm256_set1_ps(a); }
+    static inline T add(T a, T b) { return _mm256_add_ps(a, b); }
+    static inline T sub(T a, T b) { return _mm256_sub_ps(a, b); }
+    static inline T mul(T a, T b) { return _mm256_mul_ps(a, b); }
+    static inline T div(T a, T b) { return _mm256_div_ps(a, b); }
+    static inline T sqrt(T a) { return _mm256_sqrt_ps(a); }
+    static inline M mask(const unsigned char* awake) {
+        __m256i flags = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)awake));
+        return _mm256_castsi256_ps(_mm256_cmpgt_epi32(flags, _mm256_setzero_si256()));
+    }
+    static inline bool any(M m) { return _mm256_movemask_ps(m) != 0; }
+    static inline T select(M m, T a, T b) { return _mm256_blendv_ps(b, a, m); }
+};
+
+}
+
+void rk4AVX2(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceSpheres<AVX2Ops, RK4Scheme>(s, forces, begin, end, h);
+}
+
+void eulerAVX2(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceSpheres<AVX2Ops, EulerScheme>(s, forces, begin, end, h);
+}
+
+void verletAVX2(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    advanceSpheres<AVX2Ops, VerletScheme>(s, forces, begin, end, h);
+}
+#endif
@@ -0,0 +1,205 @@
+#ifndef SPHERE_KERNELS_IMPL_H
+#define SPHERE_KERNELS_IMPL_H
+
+#include "SphereKernels.h"
+#include <cmath>
+
+/**
+ * Generic sphere integration kernels, included only by the kernel
+ * translation units. Each integration scheme is written once against a set
+ * of lane operations O (O::T: O::WIDTH floats, O::M: lane mask) and
+ * instantiated for plain floats, SSE and AVX2. Everything stays in an
+ * anonymous namespace so that code compiled with different instruction sets
+ * never gets merged.
+ */
+namespace {
+
+// Lane operations for one sphere at a time
+struct ScalarOps {
+    typedef float T;
+    typedef bool M;
+    static const int WIDTH = 1;
+    static inline T load(const float* p) { return *p; }
+    static inline void store(float* p, T a) { *p = a; }
+    static inline T set(float a) { return a; }
+    static inline T add(T a, T b) { return a + b; }
+    static inline T sub(T a, T b) { return a - b; }
+    static inline T mul(T a, T b) { return a * b; }
+    static inline T div(T a, T b) { return a / b; }
+    static inline T sqrt(T a) { return std::sqrt(a); }
+    static inline M mask(const unsigned char* awake) { return *awake != 0; }
+    static inline bool any(M m) { return m; }
+    static inline T select(M m, T a, T b) { return m ? a : b; }
+};
+
+// The force field broadcast to every lane
+template <class O>
+struct LaneForces {
+    typename O::T gravity[3], drag, dragWind[3];
+
+    LaneForces(const ForceField& f) {
+        for (int k = 0; k < 3; k++) {
+            gravity[k] = O::set(f.gravity[k]);
+            dragWind[k] = O::set(f.drag * f.wind[k]);
+        }
+        drag = O::set(f.drag);
+    }
+};
+
+// Force on O::WIDTH spheres of mass m and momentum P: m * gravity + drag * wind - drag * v
+template <class O>
+inline void laneForce(const typename O::T* P, typename O::T m, const LaneForces<O>& f, typename O::T* F) {
+    for (int k = 0; k < 3; k++)
+        F[k] = O::sub(O::add(O::mul(m, f.gravity[k]), f.dragWind[k]), O::mul(f.drag, O::div(P[k], m)));
+}
+
+// q_dot = 1 / 2 * (0, w) * normalize(q), with w = I_inv * L
+template <class O>
+inline void laneSpin(const typename O::T* q, const typename O::T* L, typename O::T I_inv,
+                     typename O::T* qDot) {
+    typedef typename O::T T;
+    const T zero = O::set(0.0f), half = O::set(0.5f);
+
+    T norm = O::sqrt(O::add(O::add(O::mul(q[0], q[0]), O::mul(q[1], q[1])),
+                            O::add(O::mul(q[2], q[2]), O::mul(q[3], q[3]))));
+    T qx = O::div(q[0], norm), qy = O::div(q[1], norm);
+    T qz = O::div(q[2], norm), qw = O::div(q[3], norm);
+    T wx = O::mul(I_inv, L[0]), wy = O::mul(I_inv, L[1]), wz = O::mul(I_inv, L[2]);
+
+    qDot[0] = O::mul(half, O::add(O::mul(wx, qw), O::sub(O::mul(wy, qz), O::mul(wz, qy))));
+    qDot[1] = O::mul(half, O::add(O::mul(wy, qw), O::sub(O::mul(wz, qx), O::mul(wx, qz))));
+    qDot[2] = O::mul(half, O::add(O::mul(wz, qw), O::sub(O::mul(wx, qy), O::mul(wy, qx))));
+    qDot[3] = O::mul(half, O::sub(zero, O::add(O::mul(wx, qx), O::add(O::mul(wy, qy), O::mul(wz, qz)))));
+}
+
+/**
+ * State derivative [x, q, P, L]' of O::WIDTH spheres under the force field.
+ * It is RigidBody::dydt for an isotropic inertia (w = I_inv * L).
+ */
+template <class O>
+inline void sphereDydt(const typename O::T* y, typename O::T m, typename O::T I_inv,
+                       const LaneForces<O>& f, typename O::T* yDot) {
+    const typename O::T zero = O::set(0.0f);
+    for (int k = 0; k < 3; k++) yDot[k] = O::div(y[7 + k], m);
+    laneSpin<O>(y + 3, y + 10, I_inv, yDot + 3);
+    laneForce<O>(y + 7, m, f, yDot + 7);
+    yDot[10] = zero;
+    yDot[11] = zero;
+    yDot[12] = zero;
+}
+
+// Runge-Kutta 4th order, the scheme of RigidBody::rungeKuta4th (4 derivatives per step)
+struct RK4Scheme {
+    template <class O>
+    static inline void step(const typename O::T* y0, typename O::T m, typename O::T I_inv,
+                            const LaneForces<O>& f, typename O::T h, typename O::T* y) {
+        typedef typename O::T T;
+        const int STATES = 13;
+        const T two = O::set(2.0f), six = O::set(6.0f);
+        T k1[STATES], k2[STATES], k3[STATES], k4[STATES];
+
+        sphereDydt<O>(y0, m, I_inv, f, k1);
+        for (int k = 0; k < STATES; k++) y[k] = O::add(y0[k], O::div(O::mul(h, k1[k]), two));
+        sphereDydt<O>(y, m, I_inv, f, k2);
+        for (int k = 0; k < STATES; k++) y[k] = O::add(y0[k], O::div(O::mul(h, k2[k]), two));
+        sphereDydt<O>(y, m, I_inv, f, k3);
+        for (int k = 0; k < STATES; k++) y[k] = O::add(y0[k], O::mul(h, k3[k]));
+        sphereDydt<O>(y, m, I_inv, f, k4);
+        for (int k = 0; k < STATES; k++) {
+            T sum = O::add(O::add(k1[k], O::mul(two, k2[k])), O::add(O::mul(two, k3[k]), k4[k]));
+            y[k] = O::add(y0[k], O::div(O::mul(h, sum), six));
+        }
+    }
+};
+
+// Semi-implicit (symplectic) Euler: the momentum first, then the position with the new momentum
+struct EulerScheme {
+    template <class O>
+    static inline void step(const typename O::T* y0, typename O::T m, typename O::T I_inv,
+                            const LaneForces<O>& f, typename O::T h, typename O::T* y) {
+        typedef typename O::T T;
+        T F[3], qDot[4];
+        laneForce<O>(y0 + 7, m, f, F);
+        laneSpin<O>(y0 + 3, y0 + 10, I_inv, qDot);
+        for (int k = 0; k < 3; k++) {
+            y[7 + k] = O::add(y0[7 + k], O::mul(h, F[k]));
+            y[k] = O::add(y0[k], O::div(O::mul(h, y[7 + k]), m));
+            y[10 + k] = y0[10 + k];
+        }
+        for (int k = 0; k < 4; k++) y[3 + k] = O::add(y0[3 + k], O::mul(h, qDot[k]));
+    }
+};
+
+/**
+ * Velocity Verlet as kick - drift - kick. The drag makes the force depend on
+ * the velocity, the closing kick uses the force at the half step momentum.
+ */
+struct VerletScheme {
+    template <class O>
+    static inline void step(const typename O::T* y0, typename O::T m, typename O::T I_inv,
+                            const LaneForces<O>& f, typename O::T h, typename O::T* y) {
+        typedef typename O::T T;
+        const T halfH = O::mul(O::set(0.5f), h);
+        T F[3], qDot[4];
+        laneForce<O>(y0 + 7, m, f, F);
+        laneSpin<O>(y0 + 3, y0 + 10, I_inv, qDot);
+        for (int k = 0; k < 3; k++) {
+            y[7 + k] = O::add(y0[7 + k], O::mul(halfH, F[k]));
+            y[k] = O::add(y0[k], O::div(O::mul(h, y[7 + k]), m));
+            y[10 + k] = y0[10 + k];
+        }
+        for (int k = 0; k < 4; k++) y[3 + k] = O::add(y0[3 + k], O::mul(h, qDot[k]));
+        laneForce<O>(y + 7, m, f, F);
+        for (int k = 0; k < 3; k++) y[7 + k] = O::add(y[7 + k], O::mul(halfH, F[k]));
+    }
+};
+
+/**
+ * Advance the spheres [begin, end) in groups of O::WIDTH with the scheme S
+ * and return the first index that was not processed
+ */
+template <class O, class S>
+int advanceLanes(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    typedef typename O::T T;
+    const int STATES = 13;
+    const T hv = O::set(h);
+    const LaneForces<O> f(forces);
+    float* ptr[STATES] = {
+        s.x[0], s.x[1], s.x[2],
+        s.q[0], s.q[1], s.q[2], s.q[3],
+        s.P[0], s.P[1], s.P[2],
+        s.L[0], s.L[1], s.L[2] };
+
+    int i = begin;
+    for (; i + O::WIDTH <= end; i += O::WIDTH) {
+        typename O::M active = O::mask(s.awake + i);
+        if (!O::any(active)) continue;
+
+        T y0[STATES], y[STATES];
+        for (int k = 0; k < STATES; k++) y0[k] = O::load(ptr[k] + i);
+        T m = O::load(s.m + i);
+        T I_inv = O::load(s.I_inv + i);
+
+        S::template step<O>(y0, m, I_inv, f, hv, y);
+
+        // keep the orientation normalized, as RigidBody::setY does
+        T norm = O::sqrt(O::add(O::add(O::mul(y[3], y[3]), O::mul(y[4], y[4])),
+                                O::add(O::mul(y[5], y[5]), O::mul(y[6], y[6]))));
+        for (int k = 3; k < 7; k++) y[k] = O::div(y[k], norm);
+
+        for (int k = 0; k < STATES; k++)
+            O::store(ptr[k] + i, O::select(active, y[k], y0[k]));
+    }
+    return i;
+}
+
+// Advance [begin, end) with the lanes of O and finish the tail one sphere at a time
+template <class O, class S>
+void advanceSpheres(const SphereStates& s, const ForceField& forces, int begin, int end, float h) {
+    int i = advanceLanes<O, S>(s, forces, begin, end, h);
+    advanceLanes<ScalarOps, S>(s, forces, i, end, h);
+}
+
+}
+
+#endif
@@ -0,0 +1,28 @@
+// Include C++ headers
+#include <cstdlib>
+#include <iostream>
+
+// Include project code
+#include "SphereKernels.h"
+
+using namespace std;
+
+/**
+ * Unit test of the sphere integration kernels, registered with ctest:
+ * advances random sphere states with the scalar, SSE and AVX2 kernels this
+ * CPU supports, compares the RK4 kernels with RigidBody::rungeKuta4th and
+ * the other integrators with their scalar kernel, and fails if a kernel
+ * drifts beyond the tolerance.
+ *
+ * usage: sphere_kernels_test [tolerance]
+ */
+int main(int argc, char* argv[]) {
+    float tolerance = argc > 1 ? (float)atof(argv[1]) : 1e-4f;
+
+    cout << "Widest kernel on this CPU: " << sphereKernelName(selectSphereKernel()) << endl;
+    if (!verifySphereKernels(tolerance)) {
+        cout << "Sphere kernels differ from the reference by more than " << tolerance << endl;
+        return 1;
+    }
+    return 0;
+}
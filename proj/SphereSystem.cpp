@@ -0,0 +1,846 @@
+#include "SphereSystem.h"
+#include "Collision.h"
+#include "MeshBVH.h"
+#include "GlobalVariables.h"
+#include <GL/glew.h>
+#include <common/model.h>
+#include <glm/gtc/quaternion.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace glm;
+
+SphereSystem::SphereSystem() {
+    instanceVBO = 0;
+    maxRadius = 0.0f;
+    sleepSpeed = 0.25f;
+    sleepFrames = 30;
+    rateTiers = 3;
+    tierPixels = 2.0f;
+    stepCount = 0;
+    sortInterval = 64;
+    ccd = true;
+    ccdIterations = 4;
+    body = NULL;
+    bodyOffset = vec3(0.0f);
+    bodyLevel = 0.0f;
+    bodyBudget = 4096;
+    bodyCursor = 0;
+    solver = IMPULSE_SOLVER;
+    xpbdIterations = 4;
+    compliance = 0.0f;
+    restitution = 0.5f;
+    integrator = RK4;
+    kernel = selectSphereKernel(integrator);
+    adaptive = false;
+    tolerance = 1e-5f;
+    adaptiveStep = 0.004f;
+    minStep = 0.0005f;
+    maxStep = 0.016f;
+    contactStep = 0.004f;
+    acceptedSteps = rejectedSteps = 0;
+    clock = 0.0;
+    lastStep = 0.0f;
+    snapImpulse = 0.0f;
+    snapCenter = vec3(0.0f);
+}
+
+SphereSystem::~SphereSystem() {
+    if (instanceVBO != 0) glDeleteBuffers(1, &instanceVBO);
+}
+
+void SphereSystem::setPosition(int i, const vec3& pos) {
+    x[0][i] = pos.x;
+    x[1][i] = pos.y;
+    x[2][i] = pos.z;
+}
+
+void SphereSystem::setMomentum(int i, const vec3& mom) {
+    P[0][i] = mom.x;
+    P[1][i] = mom.y;
+    P[2][i] = mom.z;
+}
+
+int SphereSystem::add(vec3 pos, vec3 vel, float radius, float mass) {
+    if (radius == 0) throw std::logic_error("SphereSystem: radius != 0");
+    for (int k = 0; k < 3; k++) {
+        x[k].push_back(pos[k]);
+        prevX[k].push_back(pos[k]);
+        P[k].push_back(mass * vel[k]);
+        L[k].push_back(0.0f);
+    }
+    // same initial orientation as RigidBody
+    float q0[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+    for (int k = 0; k < 4; k++) {
+        q[k].push_back(q0[k]);
+        prevQ[k].push_back(q0[k]);
+    }
+    prevSteps.push_back(1);
+
+    r.push_back(radius);
+    if (radius > maxRadius) maxRadius = radius;
+    m.push_back(mass);
+    I_inv.push_back(1.0f / (2.0f / 5 * mass * radius * radius));
+    startingHeight.push_back(pos.y);
+    released.push_back(0);
+    awake.push_back(0);
+    restFrames.push_back(0);
+    settledFrames.push_back(0);
+    tier.push_back(0);
+    nextTier.push_back(0);
+
+    // reuse a free handle if there is one
+    int h;
+    if (freeHandles.empty()) {
+        h = (int)handleIndex.size();
+        handleIndex.push_back(size() - 1);
+    }
+    else {
+        h = freeHandles.back();
+        freeHandles.pop_back();
+        handleIndex[h] = size() - 1;
+    }
+    sphereHandle.push_back(h);
+    return h;
+}
+
+void SphereSystem::removeAt(int i) {
+    int last = size() - 1;
+    freeHandles.push_back(sphereHandle[i]);
+    handleIndex[sphereHandle[i]] = -1;
+    if (i != last) {
+        for (int k = 0; k < 3; k++) {
+            x[k][i] = x[k][last];
+            prevX[k][i] = prevX[k][last];
+            P[k][i] = P[k][last];
+            L[k][i] = L[k][last];
+        }
+        for (int k = 0; k < 4; k++) {
+            q[k][i] = q[k][last];
+            prevQ[k][i] = prevQ[k][last];
+        }
+        prevSteps[i] = prevSteps[last];
+        r[i] = r[last];
+        m[i] = m[last];
+        I_inv[i] = I_inv[last];
+        startingHeight[i] = startingHeight[last];
+        released[i] = released[last];
+        awake[i] = awake[last];
+        restFrames[i] = restFrames[last];
+        settledFrames[i] = settledFrames[last];
+        tier[i] = tier[last];
+        nextTier[i] = nextTier[last];
+        sphereHandle[i] = sphereHandle[last];
+        handleIndex[sphereHandle[i]] = i;
+    }
+
+    // the capacity is kept, so that the storage is reused by the next spheres
+    for (int k = 0; k < 3; k++) {
+        x[k].pop_back();
+        prevX[k].pop_back();
+        P[k].pop_back();
+        L[k].pop_back();
+    }
+    for (int k = 0; k < 4; k++) {
+        q[k].pop_back();
+        prevQ[k].pop_back();
+    }
+    prevSteps.pop_back();
+    r.pop_back();
+    m.pop_back();
+    I_inv.pop_back();
+    startingHeight.pop_back();
+    released.pop_back();
+    awake.pop_back();
+    restFrames.pop_back();
+    settledFrames.pop_back();
+    tier.pop_back();
+    nextTier.pop_back();
+    sphereHandle.pop_back();
+}
+
+void SphereSystem::remove(const std::vector<unsigned char>& dead) {
+    // backwards, so that the sphere moved into a removed slot is already checked
+    for (int i = size() - 1; i >= 0; i--) {
+        if (dead[i]) removeAt(i);
+    }
+}
+
+// Spread the lower 10 bits of v so that there are two zero bits between them
+static unsigned int spreadBits(unsigned int v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Reorder v so that v[n] becomes the old v[order[n]]
+template <class T>
+static void gather(std::vector<T>& v, const std::vector<int>& order) {
+    std::vector<T> sorted(v.size());
+    for (int n = 0; n < order.size(); n++) sorted[n] = v[order[n]];
+    v.swap(sorted);
+}
+
+void SphereSystem::sortSpatially() {
+    if (sortInterval <= 0 || stepCount % sortInterval != 0 || size() < 2) return;
+    PhaseTimer timer(stats, PhysicsStats::SORT);
+
+    // Morton keys of the positions quantized to 1024 cells per axis of the bounds
+    vec3 lo = position(0), hi = lo;
+    for (int i = 1; i < size(); i++) {
+        lo = min(lo, position(i));
+        hi = max(hi, position(i));
+    }
+    vec3 scale = 1023.0f / max(hi - lo, vec3(1e-6f));
+    mortonKeys.resize(size());
+    int unordered = 0;
+    for (int i = 0; i < size(); i++) {
+        vec3 cell = (position(i) - lo) * scale;
+        mortonKeys[i] = (spreadBits((unsigned int)cell.x) << 2) | (spreadBits((unsigned int)cell.y) << 1)
+            | spreadBits((unsigned int)cell.z);
+        if (i > 0 && mortonKeys[i - 1] > mortonKeys[i]) unordered++;
+    }
+    if (unordered * 64 <= size()) return;
+
+    sortOrder.resize(size());
+    for (int i = 0; i < size(); i++) sortOrder[i] = i;
+    const std::vector<unsigned int>& keys = mortonKeys;
+    std::sort(sortOrder.begin(), sortOrder.end(), [&keys](int a, int b) {
+        return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+    });
+
+    for (int k = 0; k < 3; k++) {
+        gather(x[k], sortOrder);
+        gather(prevX[k], sortOrder);
+        gather(P[k], sortOrder);
+        gather(L[k], sortOrder);
+    }
+    for (int k = 0; k < 4; k++) {
+        gather(q[k], sortOrder);
+        gather(prevQ[k], sortOrder);
+    }
+    gather(prevSteps, sortOrder);
+    gather(r, sortOrder);
+    gather(m, sortOrder);
+    gather(I_inv, sortOrder);
+    gather(startingHeight, sortOrder);
+    gather(released, sortOrder);
+    gather(awake, sortOrder);
+    gather(restFrames, sortOrder);
+    gather(settledFrames, sortOrder);
+    gather(tier, sortOrder);
+    gather(nextTier, sortOrder);
+    gather(sphereHandle, sortOrder);
+    for (int i = 0; i < size(); i++) handleIndex[sphereHandle[i]] = i;
+}
+
+void SphereSystem::translate(vec3 offset) {
+    for (int k = 0; k < 3; k++) {
+        float* xk = x[k].data();
+        float* prevXk = prevX[k].data();
+        for (int i = 0; i < size(); i++) {
+            xk[i] += offset[k];
+            prevXk[i] += offset[k];
+        }
+    }
+    snapCenter += offset;
+}
+
+void SphereSystem::beginStep() {
+    stats.reset();
+    if (tierCount() == 1) {
+        for (int k = 0; k < 3; k++) prevX[k] = x[k];
+        for (int k = 0; k < 4; k++) prevQ[k] = q[k];
+        prevSteps.assign(size(), 1);
+        return;
+    }
+    // a sphere in the middle of the step of its tier keeps the state it started from
+    for (int i = 0; i < size(); i++) {
+        if (!inStep(i)) continue;
+        for (int k = 0; k < 3; k++) prevX[k][i] = x[k][i];
+        for (int k = 0; k < 4; k++) prevQ[k][i] = q[k][i];
+        prevSteps[i] = tierSteps(i);
+    }
+}
+
+void SphereSystem::release(float level) {
+    PhaseTimer timer(stats, PhysicsStats::RELEASE);
+    for (int i = 0; i < size(); i++) {
+        if (released[i] || startingHeight[i] - r[i] < level) continue;
+        released[i] = 1;
+        awake[i] = 1;
+        if (snapImpulse == 0.0f) continue;
+        vec3 dir = position(i) - snapCenter;
+        dir.y = 0.0f;
+        if (dot(dir, dir) > 0.0f) {
+            dir = normalize(dir) * snapImpulse;
+            P[0][i] += dir.x;
+            P[2][i] += dir.z;
+        }
+    }
+}
+
+float SphereSystem::energy(int i) const {
+    float P2 = P[0][i] * P[0][i] + P[1][i] * P[1][i] + P[2][i] * P[2][i];
+    float L2 = L[0][i] * L[0][i] + L[1][i] * L[1][i] + L[2][i] * L[2][i];
+    // KE = 1/2 m u^T u + 1/2 w^T I w, with u = P / m and w = I_inv L
+    return x[1][i] * g_earth * m[i] + 0.5f * P2 / m[i] + 0.5f * I_inv[i] * L2;
+}
+
+SphereStates SphereSystem::states() {
+    SphereStates s = {
+        { x[0].data(), x[1].data(), x[2].data() },
+        { q[0].data(), q[1].data(), q[2].data(), q[3].data() },
+        { P[0].data(), P[1].data(), P[2].data() },
+        { L[0].data(), L[1].data(), L[2].data() },
+        m.data(), I_inv.data(), awake.data() };
+    return s;
+}
+
+void SphereSystem::setIntegrator(Integrator integrator) {
+    this->integrator = integrator;
+    kernel = selectSphereKernel(integrator);
+}
+
+float SphereSystem::integrate(float t, float h) {
+    if (solver == XPBD_SOLVER) {
+        stepXPBD(t, h);
+        stepCount++;
+        clock += h;
+        lastStep = h;
+        return h;
+    }
+
+    // Tier k is due every 2^k steps and jumps 2^k steps ahead, so all the
+    // tiers are in step again every 2^(rateTiers - 1) steps
+    {
+        PhaseTimer timer(stats, PhysicsStats::INTEGRATE);
+        if (ccd) {
+            for (int k = 0; k < 3; k++) {
+                sweepX[k] = x[k];
+                sweepP[k] = P[k];
+            }
+            for (int k = 0; k < 4; k++) sweepQ[k] = q[k];
+        }
+
+        if (adaptive) h = integrateAdaptive(t, h);
+        else {
+            SphereStates s = states();
+            for (int k = 0; k < tierCount(); k++) {
+                if (stepCount % (1 << k) != 0) continue;
+                if (tierCount() > 1) {
+                    due.resize(size());
+                    for (int i = 0; i < size(); i++) due[i] = awake[i] && tier[i] == k;
+                    s.awake = due.data();
+                }
+                for (int i = 0; i < size(); i++) stats.integrated += s.awake[i] != 0;
+                kernel(s, forces, 0, size(), h * (1 << k));
+            }
+        }
+    }
+    if (ccd) sweep(h);
+    stepCount++;
+    clock += h;
+    lastStep = h;
+    return h;
+}
+
+// Pointers to the 13 state components of s, in the order of RigidBody::State
+static void stateComponents(const SphereStates& s, float** c) {
+    for (int k = 0; k < 3; k++) c[k] = s.x[k];
+    for (int k = 0; k < 4; k++) c[3 + k] = s.q[k];
+    for (int k = 0; k < 3; k++) c[7 + k] = s.P[k];
+    for (int k = 0; k < 3; k++) c[10 + k] = s.L[k];
+}
+
+float SphereSystem::integrateAdaptive(float t, float h) {
+    SphereStates s = states();
+    float* c[13];
+    stateComponents(s, c);
+    int awakeCount = 0;
+    for (int i = 0; i < size(); i++) awakeCount += awake[i] != 0;
+    for (int k = 0; k < 13; k++) stepStart[k].assign(c[k], c[k] + size());
+
+    int order = integratorOrder(integrator);
+    h = std::max(minStep, std::min(h, maxStep));
+    while (true) {
+        // one full step, then two half steps from the same start
+        kernel(s, forces, 0, size(), h);
+        for (int k = 0; k < 13; k++) {
+            fullStep[k].assign(c[k], c[k] + size());
+            std::copy(stepStart[k].begin(), stepStart[k].end(), c[k]);
+        }
+        kernel(s, forces, 0, size(), 0.5f * h);
+        kernel(s, forces, 0, size(), 0.5f * h);
+        stats.integrated += 3 * awakeCount;
+
+        // Richardson estimate of the error of the half steps, relative to 1 + |y|
+        float error = 0.0f;
+        float richardson = 1.0f / ((1 << order) - 1);
+        for (int k = 0; k < 13; k++) {
+            for (int i = 0; i < size(); i++) {
+                if (!awake[i]) continue;
+                float y = c[k][i];
+                error = std::max(error, richardson * std::abs(y - fullStep[k][i]) / (1.0f + std::abs(y)));
+            }
+        }
+
+        // h_new = 0.9 h (tolerance / error)^(1 / (order + 1)), changing at most 5 times
+        float scale = error > 0.0f ? 0.9f * std::pow(tolerance / error, 1.0f / (order + 1)) : 5.0f;
+        float next = std::max(minStep, std::min(maxStep, h * std::min(5.0f, std::max(0.2f, scale))));
+        // the error estimate does not see the contacts, resolved once per step
+        if (stats.contacts + stats.floorContacts + stats.bodyContacts > 0) next = std::min(next, contactStep);
+        if (error <= tolerance || h <= minStep) {
+            acceptedSteps++;
+            adaptiveStep = next;
+            return h;
+        }
+        rejectedSteps++;
+        for (int k = 0; k < 13; k++) std::copy(stepStart[k].begin(), stepStart[k].end(), c[k]);
+        h = next;
+    }
+}
+
+float SphereSystem::interpolation(double time) const {
+    if (lastStep <= 0.0f) return 1.0f;
+    return (float)std::max(0.0, std::min(1.0, (time - (clock - lastStep)) / lastStep));
+}
+
+void SphereSystem::collideBody() {
+    if (body == NULL || body->nodes.empty() || size() == 0) return;
+    PhaseTimer timer(stats, PhysicsStats::BODY);
+
+    // Awake spheres that reach the box of the undissolved body, from the cursor on
+    vec3 lo = body->nodes[0].lo + bodyOffset, hi = body->nodes[0].hi + bodyOffset;
+    hi.y = std::min(hi.y, bodyLevel + bodyOffset.y);
+    bodyQueries.clear();
+    if (bodyCursor >= size()) bodyCursor = 0;
+    for (int n = 0; n < size() && bodyQueries.size() < bodyBudget; n++) {
+        int i = (bodyCursor + n) % size();
+        if (!awake[i]) continue;
+        vec3 c = position(i);
+        if (any(greaterThan(lo, c + r[i])) || any(lessThan(hi, c - r[i]))) continue;
+        bodyQueries.push_back(i);
+        bodyCursor = i + 1;
+    }
+
+    int hits = 0;
+    #pragma omp parallel for reduction(+:hits) if(bodyQueries.size() > 256)
+    for (int n = 0; n < bodyQueries.size(); n++)
+        hits += handleBodySphereCollision(*this, bodyQueries[n], *body, bodyOffset, bodyLevel);
+    stats.bodyContacts += hits;
+}
+
+void SphereSystem::sweep(float h) {
+    // contacts are aimed slightly inside, so that the discrete tests that
+    // resolve them at the time of impact always see an overlap
+    const float skin = 0.999f;
+    PhaseTimer timer(stats, PhysicsStats::SWEEP);
+    SphereStates s = states();
+
+    // The largest distance moved bounds the search for the other sphere
+    float maxMove = 0.0f;
+    for (int i = 0; i < size(); i++) {
+        vec3 a(sweepX[0][i], sweepX[1][i], sweepX[2][i]);
+        maxMove = std::max(maxMove, distance(a, position(i)));
+    }
+
+    // A sphere bounced by an earlier one sweeps on from the impact
+    sweepElapsed.assign(size(), 0.0f);
+    for (int i = 0; i < size(); i++) {
+        if (!awake[i] || !inStep(i)) continue;
+        float elapsed = sweepElapsed[i], remaining = h * tierSteps(i) * (1.0f - elapsed);
+        float start[10];
+        for (int k = 0; k < 3; k++) {
+            start[k] = sweepX[k][i];
+            start[7 + k] = sweepP[k][i];
+        }
+        for (int k = 0; k < 4; k++) start[3 + k] = sweepQ[k][i];
+
+        for (int n = 0; n < ccdIterations; n++) {
+            // a shallow floor penetration is left to the discrete test
+            vec3 a(start[0], start[1], start[2]), b = position(i);
+            float toi = b.y < 0.5f * r[i] ? sweepFloorSphere(a, b, skin * r[i]) : 2.0f;
+            int other = -1;
+            if (distance(a, b) > r[i]) {
+                vec3 margin(r[i] + maxRadius + maxMove);
+                broadphase.query(min(a, b) - margin, max(a, b) + margin, sweepCandidates);
+                for (int c = 0; c < sweepCandidates.size(); c++) {
+                    int j = sweepCandidates[c];
+                    // a sphere of a slower tier not stepped now is ahead in time
+                    if (j == i || !inStep(j)) continue;
+                    // the other sphere moves linearly over the rest of the step
+                    vec3 aj = sweptPosition(j, elapsed);
+                    float t = sweepSpheres(a, b, skin * r[i], aj, position(j), skin * r[j]);
+                    if (t < toi) {
+                        toi = t;
+                        other = j;
+                    }
+                }
+            }
+            if (toi > 1.0f) break;
+            stats.sweeps++;
+
+            // Step again from the start up to the impact
+            for (int k = 0; k < 3; k++) {
+                x[k][i] = start[k];
+                P[k][i] = start[7 + k];
+            }
+            for (int k = 0; k < 4; k++) q[k][i] = start[3 + k];
+            kernel(s, forces, i, i + 1, toi * remaining);
+
+            if (other < 0) stats.floorContacts += handleFloorSphereCollision(*this, i);
+            else {
+                // bounce off the other sphere where it is at the impact, then
+                // carry its correction and change of velocity to its end position
+                int j = other;
+                float impact = elapsed + toi * (1.0f - elapsed);
+                vec3 end = position(j), v = velocity(j);
+                vec3 atImpact = sweptPosition(j, impact);
+                setPosition(j, atImpact);
+                stats.contacts += handleSpheresCollision(*this, i, j);
+                vec3 bounced = position(j);
+                setPosition(j, end + (bounced - atImpact) + (velocity(j) - v) * (1.0f - toi) * remaining);
+                // if its own sweep is still to come, it starts from the bounce
+                // instead of stepping the whole step again
+                for (int k = 0; k < 3; k++) {
+                    sweepX[k][j] = bounced[k];
+                    sweepP[k][j] = P[k][j];
+                }
+                for (int k = 0; k < 4; k++) sweepQ[k][j] = q[k][j];
+                sweepElapsed[j] = impact;
+                // keep it out of the floor until then
+                if (x[1][j] < 0.5f * r[j]) handleFloorSphereCollision(*this, j);
+            }
+
+            // and on to the end of the step
+            for (int k = 0; k < 3; k++) {
+                start[k] = x[k][i];
+                start[7 + k] = P[k][i];
+            }
+            for (int k = 0; k < 4; k++) start[3 + k] = q[k][i];
+            elapsed += toi * (1.0f - elapsed);
+            remaining *= 1.0f - toi;
+            kernel(s, forces, i, i + 1, remaining);
+        }
+        // out of iterations, fall back to the discrete floor test
+        if (x[1][i] < 0.5f * r[i]) handleFloorSphereCollision(*this, i);
+    }
+}
+
+vec3 SphereSystem::sweptPosition(int i, float f) const {
+    vec3 start(sweepX[0][i], sweepX[1][i], sweepX[2][i]);
+    if (f <= sweepElapsed[i]) return start;
+    return mix(start, position(i), (f - sweepElapsed[i]) / (1.0f - sweepElapsed[i]));
+}
+
+void SphereSystem::collide() {
+    if (solver == XPBD_SOLVER) return;
+    {
+        PhaseTimer timer(stats, PhysicsStats::FLOOR);
+        int hits = 0;
+        #pragma omp parallel for reduction(+:hits) if(size() > 1024)
+        for (int i = 0; i < size(); i++) {
+            if (awake[i]) hits += handleFloorSphereCollision(*this, i);
+        }
+        stats.floorContacts += hits;
+    }
+    collideBody();
+    {
+        PhaseTimer timer(stats, PhysicsStats::BROADPHASE);
+        broadphase.findPairs(*this, 2.0f * maxRadius);
+        stats.candidatePairs += (int)broadphase.pairs.size();
+    }
+    PhaseTimer timer(stats, PhysicsStats::CONTACTS);
+    if (tierCount() == 1) {
+        stats.contacts += handleSpheresCollisions(*this, broadphase.pairs, contacts);
+        return;
+    }
+    // a sphere of a slower tier is ahead of the spheres stepped since its own
+    // step, it meets them when the step integrates both
+    stepPairs.clear();
+    for (int p = 0; p < broadphase.pairs.size(); p++) {
+        if (inStep(broadphase.pairs[p].first) && inStep(broadphase.pairs[p].second))
+            stepPairs.push_back(broadphase.pairs[p]);
+    }
+    stats.contacts += handleSpheresCollisions(*this, stepPairs, contacts);
+}
+
+// Run f(p) for every pair of the contact batches, the pairs of a batch in parallel
+template <class F>
+static void forEachContact(const ContactBatches& batches, F f) {
+    int colors = (int)batches.batchStart.size() - 2;
+    for (int c = 0; c < colors; c++) {
+        int begin = batches.batchStart[c], end = batches.batchStart[c + 1];
+        #pragma omp parallel for if(end - begin > 256)
+        for (int p = begin; p < end; p++) f(p);
+    }
+    for (int p = batches.batchStart[colors]; p < batches.batchStart[colors + 1]; p++) f(p);
+}
+
+void SphereSystem::stepXPBD(float t, float h) {
+    int n = size();
+    double start = omp_get_wtime();
+    for (int k = 0; k < 3; k++) xpbdStart[k] = x[k];
+
+    // Predict the positions under the force field, P keeps the velocity before the solve
+    SphereKernel predict = selectSphereKernel(SEMI_IMPLICIT_EULER);
+    predict(states(), forces, 0, n, h);
+    for (int i = 0; i < n; i++) stats.integrated += awake[i] != 0;
+    stats.time[PhysicsStats::INTEGRATE] += omp_get_wtime() - start;
+
+    // Contacts at the predicted positions, a sleeping sphere does not move
+    // (zero inverse mass) during the step, it is woken up after it
+    start = omp_get_wtime();
+    broadphase.findPairs(*this, 2.0f * maxRadius);
+    stats.candidatePairs += (int)broadphase.pairs.size();
+    stats.time[PhysicsStats::BROADPHASE] += omp_get_wtime() - start;
+    start = omp_get_wtime();
+    contacts.build(broadphase.pairs, n);
+    pairLambda.assign(contacts.pairs.size(), 0.0f);
+    floorLambda.assign(n, 0.0f);
+    float alpha = compliance / (h * h);
+
+    for (int it = 0; it < xpbdIterations; it++) {
+        #pragma omp parallel for if(n > 1024)
+        for (int i = 0; i < n; i++) {
+            if (!awake[i]) continue;
+            float C = x[1][i] - r[i];
+            if (C >= 0.0f) continue;
+            float w = 1.0f / m[i];
+            float dLambda = (-C - alpha * floorLambda[i]) / (w + alpha);
+            floorLambda[i] += dLambda;
+            x[1][i] += w * dLambda;
+        }
+        forEachContact(contacts, [this, alpha](int p) {
+            int i = contacts.pairs[p].first, j = contacts.pairs[p].second;
+            float wi = awake[i] ? 1.0f / m[i] : 0.0f;
+            float wj = awake[j] ? 1.0f / m[j] : 0.0f;
+            if (wi + wj == 0.0f) return;
+            vec3 d = position(i) - position(j);
+            float dist = length(d);
+            float C = dist - (r[i] + r[j]);
+            if (C >= 0.0f || dist == 0.0f) return;
+            float dLambda = (-C - alpha * pairLambda[p]) / (wi + wj + alpha);
+            pairLambda[p] += dLambda;
+            vec3 dn = d * (dLambda / dist);
+            setPosition(i, position(i) + wi * dn);
+            setPosition(j, position(j) - wj * dn);
+        });
+    }
+
+    // Velocities from the motion. The contacts bounce with the restitution
+    // of the approach speed (fast enough not to be resting contact) and keep
+    // 0.9 of their tangential velocity, as the impulse solver keeps 0.9 of
+    // the momentum.
+    float restingSpeed = 2.0f * g_earth * h;
+    for (int k = 0; k < 3; k++) xpbdV[k].resize(n);
+    for (int i = 0; i < n; i++) {
+        if (!awake[i]) continue;
+        vec3 v = (position(i) - vec3(xpbdStart[0][i], xpbdStart[1][i], xpbdStart[2][i])) / h;
+        if (floorLambda[i] > 0.0f) {
+            float vnBefore = P[1][i] / m[i];
+            v.y = vnBefore < -restingSpeed ? -restitution * vnBefore : std::max(v.y, 0.0f);
+            v.x *= 0.9f;
+            v.z *= 0.9f;
+        }
+        for (int k = 0; k < 3; k++) xpbdV[k][i] = v[k];
+    }
+    forEachContact(contacts, [this, restingSpeed](int p) {
+        if (pairLambda[p] <= 0.0f) return;
+        int i = contacts.pairs[p].first, j = contacts.pairs[p].second;
+        float wi = awake[i] ? 1.0f / m[i] : 0.0f;
+        float wj = awake[j] ? 1.0f / m[j] : 0.0f;
+        if (wi + wj == 0.0f) return;
+        vec3 normal = normalize(position(i) - position(j));
+        vec3 vi(xpbdV[0][i], xpbdV[1][i], xpbdV[2][i]), vj(xpbdV[0][j], xpbdV[1][j], xpbdV[2][j]);
+        float vn = dot(vi - vj, normal);
+        float vnBefore = dot(velocity(i) - velocity(j), normal);
+        float target = vnBefore < -restingSpeed ? -restitution * vnBefore : 0.0f;
+        vec3 dv = normal * ((target - vn) / (wi + wj));
+        vi += wi * dv;
+        vj -= wj * dv;
+        for (int k = 0; k < 3; k++) {
+            xpbdV[k][i] = vi[k];
+            xpbdV[k][j] = vj[k];
+        }
+    });
+    for (int i = 0; i < n; i++) {
+        if (!awake[i]) continue;
+        for (int k = 0; k < 3; k++) P[k][i] = m[i] * xpbdV[k][i];
+    }
+    // a contact is a constraint that pushed, the sleeping spheres it pushed
+    // against move from the next step on
+    for (int p = 0; p < pairLambda.size(); p++) {
+        if (pairLambda[p] <= 0.0f) continue;
+        stats.contacts++;
+        int i = contacts.pairs[p].first, j = contacts.pairs[p].second;
+        if (!awake[i]) wake(i);
+        if (!awake[j]) wake(j);
+    }
+    for (int i = 0; i < n; i++) stats.floorContacts += floorLambda[i] > 0.0f;
+    stats.time[PhysicsStats::CONTACTS] += omp_get_wtime() - start;
+    collideBody();
+}
+
+// Root of the island of sphere i, with path halving
+static int findIsland(std::vector<int>& island, int i) {
+    while (island[i] != i) {
+        island[i] = island[island[i]];
+        i = island[i];
+    }
+    return i;
+}
+
+void SphereSystem::updateSleeping() {
+    PhaseTimer timer(stats, PhysicsStats::SLEEPING);
+    // Count the frames each awake sphere has been at rest
+    float sleepSpeed2 = sleepSpeed * sleepSpeed;
+    for (int i = 0; i < size(); i++) {
+        if (!awake[i]) continue;
+        float P2 = P[0][i] * P[0][i] + P[1][i] * P[1][i] + P[2][i] * P[2][i];
+        if (P2 < sleepSpeed2 * m[i] * m[i]) {
+            if (restFrames[i] < 0xffff) restFrames[i]++;
+        }
+        else restFrames[i] = 0;
+    }
+
+    // Islands of touching spheres, from the last broadphase pairs
+    island.resize(size());
+    for (int i = 0; i < size(); i++) island[i] = i;
+    const std::vector<std::pair<int, int>>& pairs = broadphase.pairs;
+    for (int p = 0; p < pairs.size(); p++) {
+        int i = pairs[p].first, j = pairs[p].second;
+        float d = distance(position(i), position(j));
+        if (d > 1.01f * (r[i] + r[j])) continue;
+        int a = findIsland(island, i), b = findIsland(island, j);
+        if (a != b) island[std::max(a, b)] = std::min(a, b);
+    }
+
+    // An island sleeps only if it lies on the floor and every sphere in it
+    // is at rest (sleeping spheres count as at rest), otherwise all of it is
+    // awake. Spheres in flight never sleep, even at the top of their arc.
+    std::vector<unsigned char>& rested = islandRested;
+    rested.assign(size(), 2);
+    for (int i = 0; i < size(); i++) {
+        if (!released[i]) continue;
+        int root = findIsland(island, i);
+        if (awake[i] && restFrames[i] < sleepFrames) rested[root] = 0;
+        else if (x[1][i] - r[i] < 0.1f * r[i] && rested[root] == 2) rested[root] = 1;
+    }
+    for (int i = 0; i < size(); i++) {
+        if (rested[i] == 2) rested[i] = 0;
+    }
+    for (int i = 0; i < size(); i++) {
+        if (!released[i]) continue;
+        if (rested[findIsland(island, i)]) {
+            if (!awake[i]) continue;
+            awake[i] = 0;
+            for (int k = 0; k < 3; k++) {
+                P[k][i] = 0.0f;
+                L[k][i] = 0.0f;
+            }
+        }
+        else if (!awake[i]) wake(i);
+    }
+
+    // Apply the requested rate tiers when every tier is in step, touching
+    // spheres take the fastest tier of their island
+    int tiers = tierCount();
+    if (stepCount % (1 << (tiers - 1)) == 0) {
+        std::vector<unsigned char>& islandTier = rested;
+        islandTier.assign(size(), tiers - 1);
+        for (int i = 0; i < size(); i++) {
+            int root = findIsland(island, i);
+            islandTier[root] = std::min(islandTier[root], nextTier[i]);
+        }
+        for (int i = 0; i < size(); i++)
+            tier[i] = islandTier[findIsland(island, i)];
+    }
+}
+
+void SphereSystem::frustumPlanes(const mat4& viewProjection, vec4 planes[6]) {
+    for (int k = 0; k < 3; k++) {
+        vec4 row = vec4(viewProjection[0][k], viewProjection[1][k], viewProjection[2][k], viewProjection[3][k]);
+        vec4 w = vec4(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+        planes[2 * k] = w + row;
+        planes[2 * k + 1] = w - row;
+    }
+    for (int k = 0; k < 6; k++)
+        planes[k] /= length(vec3(planes[k]));
+}
+
+void SphereSystem::cull(const mat4& viewProjection, bool releasedOnly) {
+    vec4 planes[6];
+    frustumPlanes(viewProjection, planes);
+
+    visible.clear();
+    for (int i = 0; i < size(); i++) {
+        if (releasedOnly && !released[i]) continue;
+        bool inside = true;
+        for (int k = 0; k < 6 && inside; k++) {
+            float d = planes[k].x * x[0][i] + planes[k].y * x[1][i] + planes[k].z * x[2][i] + planes[k].w;
+            inside = d >= -r[i];
+        }
+        if (inside) visible.push_back(i);
+    }
+}
+
+void SphereSystem::scheduleTiers(const mat4& viewProjection, float pixelScale) {
+    unsigned char slowest = tierCount() - 1;
+    nextTier.assign(size(), slowest);
+    for (int n = 0; n < visible.size(); n++) {
+        int i = visible[n];
+        // depth is the clip space w
+        float depth = viewProjection[0][3] * x[0][i] + viewProjection[1][3] * x[1][i]
+            + viewProjection[2][3] * x[2][i] + viewProjection[3][3];
+        bool large = r[i] * pixelScale >= tierPixels * depth;
+        nextTier[i] = std::min<unsigned char>(slowest, large ? 0 : 1);
+    }
+}
+
+int SphereSystem::writeInstanceMatrices(float alpha) {
+    instanceMatrices.resize(visible.size());
+    for (int n = 0; n < visible.size(); n++) {
+        int i = visible[n];
+        // a sphere stepped over several steps is interpolated over all of them
+        float a = alpha;
+        if (prevSteps[i] > 1 && stepCount > 0) a = ((stepCount - 1) % prevSteps[i] + alpha) / prevSteps[i];
+        // lerp the position and nlerp the orientation along the shortest arc
+        quat q1 = quat(q[3][i], q[0][i], q[1][i], q[2][i]);
+        quat q0 = quat(prevQ[3][i], prevQ[0][i], prevQ[1][i], prevQ[2][i]);
+        if (dot(q0, q1) < 0.0f) q0 = -q0;
+        quat qi = normalize(q0 * (1.0f - a) + q1 * a);
+        vec3 xi = mix(vec3(prevX[0][i], prevX[1][i], prevX[2][i]), position(i), a);
+
+        // translation * rotation * scale
+        mat4 M = mat4_cast(qi);
+        M[0] *= r[i];
+        M[1] *= r[i];
+        M[2] *= r[i];
+        M[3] = vec4(xi, 1.0f);
+        instanceMatrices[n] = M;
+    }
+    return (int)instanceMatrices.size();
+}
+
+void SphereSystem::draw(Drawable* mesh) {
+    if (instanceMatrices.empty()) return;
+    mesh->bind();
+    if (instanceVBO == 0) glGenBuffers(1, &instanceVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, instanceMatrices.size() * sizeof(mat4),
+                 &instanceMatrices[0], GL_STREAM_DRAW);
+    // a mat4 attribute takes 4 consecutive locations, one per column
+    for (int k = 0; k < 4; k++) {
+        glEnableVertexAttribArray(3 + k);
+        glVertexAttribPointer(3 + k, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void*)(k * sizeof(vec4)));
+        glVertexAttribDivisor(3 + k, 1);
+    }
+    glDrawElementsInstanced(GL_TRIANGLES, mesh->indices.size(), GL_UNSIGNED_INT, NULL, instanceMatrices.size());
+}
@@ -0,0 +1,286 @@
+#ifndef SPHERE_SYSTEM_H
+#define SPHERE_SYSTEM_H
+
+#include "SphereKernels.h"
+#include "Broadphase.h"
+#include "Collision.h"
+#include "PhysicsStats.h"
+#include <vector>
+#include <glm/glm.hpp>
+
+class Drawable;
+class MeshBVH;
+
+/** How the contacts between the spheres and with the floor are resolved */
+enum ContactSolver {
+    /** velocity exchange impulses and position nudges, before the integration */
+    IMPULSE_SOLVER,
+    /** Extended Position-Based Dynamics: iterative non-penetration constraints after the integration */
+    XPBD_SOLVER
+};
+
+/**
+ * Holds every sphere of a model in contiguous structure-of-arrays storage
+ * (one array per state component) and advances them in batches. Each
+ * state component is laid out the same way as RigidBody::State.
+ */
+class SphereSystem {
+public:
+    /** x: position, q: orientation (x, y, z, w), P: momentum, L: angular momentum */
+    std::vector<float> x[3], q[4], P[3], L[3];
+    /**
+     * position and orientation at the start of the last step of each sphere,
+     * for render interpolation, and the number of steps that step spans
+     * (2^k for a sphere of tier k)
+     */
+    std::vector<float> prevX[3], prevQ[4];
+    std::vector<unsigned char> prevSteps;
+    /** r: radius, m: mass, I_inv: inverse inertia (a scalar for spheres) */
+    std::vector<float> r, m, I_inv;
+    /** largest radius ever added, sizes the broadphase grid */
+    float maxRadius;
+    /** starting height of each sphere, used to release it during the dissolve */
+    std::vector<float> startingHeight;
+    /** spheres that have been released by the dissolve */
+    std::vector<unsigned char> released;
+    /**
+     * released spheres that are being simulated, a released sphere that is
+     * not awake is sleeping and skips integration and floor collisions
+     */
+    std::vector<unsigned char> awake;
+    /** consecutive frames each sphere has moved slower than sleepSpeed */
+    std::vector<unsigned short> restFrames;
+    /** consecutive frames each sphere has been below the removal energy, counted by removeSpheres */
+    std::vector<unsigned short> settledFrames;
+    /** an island of touching spheres sleeps after all of them rested sleepFrames frames */
+    float sleepSpeed;
+    int sleepFrames;
+    /**
+     * rate tier of each sphere, tier k is integrated every 2^k steps with a
+     * 2^k times larger step. nextTier is the tier requested by scheduleTiers,
+     * applied per island when every tier is in step again. In between, a
+     * sphere of a slower tier is ahead of the spheres stepped since its own
+     * step: it is drawn interpolated over its step, and it only meets other
+     * spheres on the steps that integrate both.
+     */
+    std::vector<unsigned char> tier, nextTier;
+    /** number of rate tiers (1 disables multi-rate stepping) */
+    int rateTiers;
+    /** visible spheres with a smaller radius on screen (in pixels) are simulated at half rate */
+    float tierPixels;
+    /** steps taken so far, decides which tiers are due */
+    int stepCount;
+    /** awake spheres of the tier being integrated */
+    std::vector<unsigned char> due;
+    /** candidate pairs of spheres that are both integrated by the step, the ones collide resolves */
+    std::vector<std::pair<int, int>> stepPairs;
+    /**
+     * Continuous collision detection: the spheres that sink more than half
+     * their radius into the floor or that move more than their radius and
+     * hit another sphere during a step are
+     * stepped again up to the time of impact, bounced and stepped on for the
+     * rest of the step, at most ccdIterations times per step
+     */
+    bool ccd;
+    int ccdIterations;
+    /**
+     * state at the start of the step being integrated, for the swept tests,
+     * and the fraction of the step it is at: later than 0 for the spheres
+     * bounced by the sweep of another one
+     */
+    std::vector<float> sweepX[3], sweepQ[4], sweepP[3];
+    std::vector<float> sweepElapsed;
+    std::vector<int> sweepCandidates;
+    /**
+     * The undissolved part of the body the spheres bounce off: the mesh
+     * hierarchy (shared by the models, none if null), where the model is and
+     * its dissolve level in model space
+     */
+    const MeshBVH* body;
+    glm::vec3 bodyOffset;
+    float bodyLevel;
+    /**
+     * At most bodyBudget spheres are tested against the body per step, the
+     * next step goes on from bodyCursor so that every sphere gets its turn
+     */
+    int bodyBudget;
+    int bodyCursor;
+    std::vector<int> bodyQueries;
+    /** contact solver, switched at runtime */
+    ContactSolver solver;
+    /**
+     * XPBD: constraint iterations per step, compliance (inverse stiffness,
+     * 0 is rigid) of the contacts and restitution of the approach speed
+     */
+    int xpbdIterations;
+    float compliance;
+    float restitution;
+    /** XPBD: positions at the start of the step, solved velocities and Lagrange multipliers */
+    std::vector<float> xpbdStart[3], xpbdV[3];
+    std::vector<float> pairLambda, floorLambda;
+    /** the storage is sorted in Morton order every sortInterval steps (0 disables it) */
+    int sortInterval;
+    /** Morton keys of the spheres and the sorted order */
+    std::vector<unsigned int> mortonKeys;
+    std::vector<int> sortOrder;
+    /**
+     * Stable handles: the spheres move in storage when others are removed
+     * or when it is sorted, a handle keeps naming the same sphere.
+     * handleIndex: storage index of each handle (-1 if free),
+     * sphereHandle: handle of each sphere, freeHandles: handles to reuse.
+     */
+    std::vector<int> handleIndex, sphereHandle, freeHandles;
+    /** spheres that survived the last cull, in drawing order */
+    std::vector<int> visible;
+    /** model matrices of the visible spheres, uploaded as per-instance data */
+    std::vector<glm::mat4> instanceMatrices;
+    /** instanceVBO: per-instance model matrix buffer */
+    unsigned int instanceVBO;
+    /** integration scheme, and its kernel selected at runtime for this CPU */
+    Integrator integrator;
+    SphereKernel kernel;
+    /**
+     * Adaptive stepping with the impulse solver: the caller steps the system
+     * by adaptiveStep until its clock catches up, rather than by a fixed
+     * step. Every step estimates the error of the integrator by step
+     * doubling (one step against two half steps of the same kernel), is
+     * retried shorter while the error exceeds tolerance, and sizes the next
+     * step between minStep and maxStep. The contacts are resolved once per
+     * step whatever its size, so a step with contacts keeps the next one
+     * within contactStep: free flight takes long steps, bounces short ones.
+     * Rate tiers do not apply.
+     */
+    bool adaptive;
+    float tolerance;
+    float adaptiveStep, minStep, maxStep, contactStep;
+    /** accepted and rejected adaptive steps so far */
+    int acceptedSteps, rejectedSteps;
+    /** time the system has been advanced to, and the size of the last step */
+    double clock;
+    float lastStep;
+    /** state components (as in SphereStates) at the start of an adaptive step and after the full step */
+    std::vector<float> stepStart[13], fullStep[13];
+    /** gravity, drag and wind applied to every sphere */
+    ForceField forces;
+    /**
+     * radial "snap" impulse, given once to every sphere when it is released
+     * and pointing away from the vertical axis through snapCenter
+     */
+    float snapImpulse;
+    glm::vec3 snapCenter;
+    /** spatial hash that finds the sphere pairs that may collide */
+    Broadphase broadphase;
+    /** union-find parents of the islands of touching spheres, and their rest state */
+    std::vector<int> island;
+    std::vector<unsigned char> islandRested;
+    /** the candidate pairs split into batches for the parallel contact solver */
+    ContactBatches contacts;
+    /** counters and phase times of the current step, reset by beginStep */
+    PhysicsStats stats;
+
+    SphereSystem();
+    ~SphereSystem();
+
+    int size() const { return (int)r.size(); }
+    glm::vec3 position(int i) const { return glm::vec3(x[0][i], x[1][i], x[2][i]); }
+    glm::vec3 velocity(int i) const { return glm::vec3(P[0][i], P[1][i], P[2][i]) / m[i]; }
+    void setPosition(int i, const glm::vec3& pos);
+    void setMomentum(int i, const glm::vec3& mom);
+    /** Pointers to the state arrays, for the integration kernels */
+    SphereStates states();
+
+    /** Storage index of the sphere with handle h, -1 if it was removed */
+    int index(int h) const { return handleIndex[h]; }
+    /** Append a sphere with the given position, velocity, radius and mass, returns its handle */
+    int add(glm::vec3 pos, glm::vec3 vel, float radius, float mass);
+    /** Remove sphere i in O(1), the last sphere takes its place */
+    void removeAt(int i);
+    /** Remove the spheres flagged in dead, O(1) per removed sphere */
+    void remove(const std::vector<unsigned char>& dead);
+    /**
+     * Every sortInterval steps, reorder the storage along a Z-order curve so
+     * that spheres close in space are close in memory. Skipped while at most
+     * 1 / 64 of the neighbours in memory are out of order.
+     */
+    void sortSpatially();
+    /** Move every sphere (and snapCenter) by offset */
+    void translate(glm::vec3 offset);
+    /**
+     * Store the current positions and orientations of the spheres the step
+     * integrates as the previous ones, and reset the stats
+     */
+    void beginStep();
+    /** Release the spheres whose top is above level and apply the snap impulse */
+    void release(float level);
+    /** Wake sphere i (and, on the next updateSleeping, its island) up */
+    void wake(int i) { awake[i] = released[i]; restFrames[i] = 0; }
+    /** Kinetic plus gravitational potential energy of sphere i */
+    float energy(int i) const;
+
+    /** Rate tiers in use, the XPBD solver and adaptive stepping step every sphere at full rate */
+    int tierCount() const { return solver == XPBD_SOLVER || adaptive ? 1 : rateTiers; }
+    /** Number of steps sphere i is integrated over at once, 2^k for tier k */
+    int tierSteps(int i) const { return tierCount() > 1 ? 1 << tier[i] : 1; }
+    /** Whether the next step integrates sphere i, its state is then at the time of the step start */
+    bool inStep(int i) const { return stepCount % tierSteps(i) == 0; }
+
+    /** Switch the integration scheme, and the kernel with it */
+    void setIntegrator(Integrator integrator);
+    /**
+     * Advance the awake spheres of the tiers due from t to t + h under the
+     * force field, sub-stepping the ones that collide on the way if ccd is on.
+     * Returns the step taken, shorter than h if an adaptive step was rejected.
+     */
+    float integrate(float t, float h);
+    /** Take an adaptive step of at most h, returns the step taken */
+    float integrateAdaptive(float t, float h);
+    /** Render interpolation factor at time, between the last two states */
+    float interpolation(double time) const;
+    /** Bounce the awake spheres near the body off its undissolved surface, within the budget */
+    void collideBody();
+    /** Swept collision tests of the spheres integrate just moved, and their sub-steps */
+    void sweep(float h);
+    /** Position of sphere i at fraction f of the step being swept, moving linearly from its sweep start */
+    glm::vec3 sweptPosition(int i, float f) const;
+    /**
+     * XPBD step of every awake sphere (rate tiers and ccd do not apply,
+     * the constraints keep the spheres apart): predict with semi-implicit Euler,
+     * project the floor and sphere constraints xpbdIterations times (the
+     * pairs in parallel batches), then derive the velocities from the
+     * positions and apply the restitution of the contacts
+     */
+    void stepXPBD(float t, float h);
+    /**
+     * Resolve floor collisions of the awake spheres, then sphere to sphere
+     * collisions of the candidate pairs found by the broadphase (in parallel).
+     * A sleeping sphere that gets hit wakes up. Nothing to do with XPBD,
+     * that resolves the contacts in integrate.
+     */
+    void collide();
+    /**
+     * Group the released spheres into islands of touching spheres, put the
+     * islands that are at rest to sleep and wake the rest up
+     */
+    void updateSleeping();
+    /** The six normalized view frustum planes of viewProjection (Gribb - Hartmann) */
+    static void frustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+    /** Keep the spheres that intersect the view frustum of viewProjection */
+    void cull(const glm::mat4& viewProjection, bool releasedOnly = true);
+    /**
+     * Request the rate tiers from the last cull: full rate for the visible
+     * spheres at least tierPixels large on screen, half rate for the smaller
+     * visible ones and the slowest rate for the rest. pixelScale converts
+     * radius / depth to pixels (projection[1][1] * viewport height / 2).
+     */
+    void scheduleTiers(const glm::mat4& viewProjection, float pixelScale);
+    /**
+     * Fill instanceMatrices for the visible spheres, interpolated by alpha
+     * between the previous and the current state (over the steps of their
+     * tier for the slower ones). Returns their number.
+     */
+    int writeInstanceMatrices(float alpha = 1.0f);
+    /** Draw the visible spheres with one instanced call */
+    void draw(Drawable* mesh);
+};
+
+#endif
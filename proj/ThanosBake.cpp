@@ -0,0 +1,73 @@
+// Include C++ headers
+#include <iostream>
+#include <string>
+
+// Include GLM
+#include <glm/glm.hpp>
+
+// Include openmp
+#include <omp.h>
+
+// Model loading
+#include <common/model.h>
+
+// Include project code
+#include "SphereFit.h"
+#include "EffectCache.h"
+
+using namespace std;
+using namespace glm;
+
+/**
+ * Offline bake of the fit data of the body mesh: computes the limits, the
+ * triangles of every bounding box, the billboard map, the fitted spheres
+ * and the voxel grid and distance field of the body with the default
+ * parameters of the game and writes them to the cache it reads at startup.
+ *
+ * usage: thanos_bake [mesh.obj] [cache file]
+ */
+
+// Global data used in SphereFit.cpp, as main.cpp holds them in the game
+float limits[5][6];
+vector<vector<bool>> billboardMap(5);
+vector<float> b_levels;
+MeshBVH* bodyBVH;
+VoxelGrid bodyVoxels;
+SignedDistanceField bodySDF;
+
+int main(int argc, char* argv[]) {
+    string mesh = argc > 1 ? argv[1] : "models/BodyMesh.obj";
+    string cache = argc > 2 ? argv[2] : "fit_cache.bin";
+
+    vector<vec3> vertices, normals;
+    vector<vec2> uvs;
+    try {
+        loadOBJWithTiny(mesh, vertices, uvs, normals);
+    }
+    catch (exception& ex) {
+        cout << ex.what() << endl;
+        return -1;
+    }
+    if (vertices.empty()) {
+        cout << "No triangles in " << mesh << endl;
+        return -1;
+    }
+
+    double start = omp_get_wtime();
+    FitParameters params;
+    FitData fit;
+    bodyBVH = new MeshBVH();
+    bodyBVH->build(vertices);
+    bakeFitData(vertices, params, fit);
+    double end = omp_get_wtime();
+    delete bodyBVH;
+
+    if (!saveFitCache(cache, hashMesh(vertices), params, fit)) {
+        cout << "Could not write " << cache << endl;
+        return -1;
+    }
+    cout << "Baked " << mesh << " (" << vertices.size() / 3 << " triangles) into " << cache << " in "
+        << end - start << " seconds: " << fit.spheres.size() << " spheres, " << fit.levels.size()
+        << " billboard levels" << endl;
+    return 0;
+}
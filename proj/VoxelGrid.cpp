@@ -0,0 +1,65 @@
+#include "VoxelGrid.h"
+#include "MeshBVH.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace glm;
+
+VoxelGrid::VoxelGrid() {
+    lo = vec3(0.0f);
+    cellSize = 0.0f;
+    dims[0] = dims[1] = dims[2] = 0;
+}
+
+void VoxelGrid::build(const MeshBVH& mesh, float cellSize) {
+    this->cellSize = cellSize;
+    cells.clear();
+    if (mesh.nodes.empty()) {
+        dims[0] = dims[1] = dims[2] = 0;
+        return;
+    }
+
+    // One cell of margin around the bounds of the mesh
+    lo = mesh.nodes[0].lo - vec3(cellSize);
+    vec3 extent = mesh.nodes[0].hi + vec3(cellSize) - lo;
+    for (int k = 0; k < 3; k++) dims[k] = std::max(1, (int)std::ceil(extent[k] / cellSize));
+    cells.assign((size_t)dims[0] * dims[1] * dims[2], 0);
+
+    // The ray of every column starts below the grid, its crossings are
+    // sorted and walked along with the cell centers
+    int columns = dims[0] * dims[1];
+    #pragma omp parallel
+    {
+        std::vector<float> hits;
+        #pragma omp for schedule(dynamic, 64)
+        for (int c = 0; c < columns; c++) {
+            int ix = c % dims[0], iy = c / dims[0];
+            vec3 origin = lo + vec3((ix + 0.5f) * cellSize, (iy + 0.5f) * cellSize, -cellSize);
+            mesh.rayHits(origin, vec3(0.0f, 0.0f, 1.0f), hits);
+            if (hits.empty()) continue;
+            std::sort(hits.begin(), hits.end());
+            int below = 0;
+            for (int iz = 0; iz < dims[2]; iz++) {
+                float z = (iz + 1.5f) * cellSize;
+                while (below < hits.size() && hits[below] < z) below++;
+                cells[((size_t)iz * dims[1] + iy) * dims[0] + ix] = (hits.size() - below) % 2;
+            }
+        }
+    }
+}
+
+bool VoxelGrid::inside(const vec3& p) const {
+    assert(!empty());
+    vec3 cell = (p - lo) / cellSize;
+    if (cell.x < 0.0f || cell.y < 0.0f || cell.z < 0.0f) return false;
+    int ix = (int)cell.x, iy = (int)cell.y, iz = (int)cell.z;
+    if (ix >= dims[0] || iy >= dims[1] || iz >= dims[2]) return false;
+    return cells[((size_t)iz * dims[1] + iy) * dims[0] + ix] != 0;
+}
+
+int VoxelGrid::occupied() const {
+    int count = 0;
+    for (size_t i = 0; i < cells.size(); i++) count += cells[i];
+    return count;
+}
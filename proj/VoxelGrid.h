@@ -0,0 +1,39 @@
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+class MeshBVH;
+
+/**
+ * Occupancy grid of a closed mesh, in model space. It is filled one
+ * (x, y) column at a time: a single ray along +z through the column finds
+ * every crossing of the surface, and the cells of the column are inside
+ * where an odd number of crossings lies beyond them (the parity test of
+ * point_inside, for the whole column at once).
+ */
+class VoxelGrid {
+public:
+    /** corner of the first cell, cell side and cells per axis */
+    glm::vec3 lo;
+    float cellSize;
+    int dims[3];
+    /** 1 for the cells whose center is inside the mesh, x fastest then y then z */
+    std::vector<unsigned char> cells;
+
+    VoxelGrid();
+    /** Voxelize the mesh of a hierarchy in cells of the given side, over its bounds */
+    void build(const MeshBVH& mesh, float cellSize);
+    /**
+     * Whether the cell that holds p is inside, O(1). Points off the grid are
+     * outside. The grid must have been built or loaded from the fit cache.
+     */
+    bool inside(const glm::vec3& p) const;
+    /** Whether the grid has no cells, neither built nor loaded yet */
+    bool empty() const { return cells.empty(); }
+    /** Number of inside cells */
+    int occupied() const;
+};
+
+#endif
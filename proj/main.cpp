@@ -1,6 +1,8 @@
 // Include C++ headers
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <cstring>
 
 // Include GLEW
 #include <GL/glew.h>
@@ -23,11 +25,13 @@
 #include <common/model.h>
 
 // Include project code
-#include "Sphere.h"
+#include "SphereSystem.h"
+#include "MeshBVH.h"
 #include "BoundingBox.h"
 #include "Collision.h"
 #include "Box.h"
 #include "SphereFit.h"
+#include "EffectCache.h"
 #include "GlobalVariables.h"
 #include "Simulation.h"
 #include "Billboard.h"
@@ -55,16 +59,20 @@ void free();
 GLFWwindow* window;
 Camera* camera;
 GLuint shaderProgram;
-GLuint projectionMatrixLocation, viewMatrixLocation, modelMatrixLocation;
+GLuint projectionMatrixLocation, viewMatrixLocation, modelMatrixLocation, instancedLocation;
 float limits[5][6];
 Drawable* thanos;
+Drawable* sphereMesh;
+MeshBVH* bodyBVH;
+VoxelGrid bodyVoxels;
+SignedDistanceField bodySDF;
+const char* fit_cache = "fit_cache.bin";
 vector<BillboardGenerator*> bboard_generator(N);
 vector<Drawable*> models;
 vector<vector<BoundingBox*>> bbox(N, vector<BoundingBox*>(5));
-vector<vector<Sphere*>> spheres(N);
+vector<SphereSystem*> spheres(N);
 vector<vector<bool>> billboardMap(5);
 vector<float> b_levels;
-vector<vector<float>> spheresStartingHeight(N);
 
 // Global variables
 bool clicked = false;
@@ -73,10 +81,33 @@ bool extinct[N] = { false };
 float disp_level[N];
 float disp_speed = 2.5f;
 float bboard_size = 0.02f;
+bool adaptive_packing = false;
+int sphere_budget = 0;
 bool sim[N] = { false };
 bool wireframe = false;
 int b_level_counter[N] = { 0 };
 float model_speed = 0.01f;
+float physics_step = 0.004f;
+int max_substeps = 8;
+bool adaptive_steps = false;
+int removal_frames = 500;
+// Forces on the spheres: the radial push of the snap (momentum), linear air
+// drag and a breeze slower than sleepSpeed, so that the piles still sleep
+float snap_impulse = 0.15f;
+float air_drag = 0.1f;
+vec3 wind_velocity(0.2f, 0.0f, 0.0f);
+Integrator integrator = RK4;
+ContactSolver solver = IMPULSE_SOLVER;
+DissolveRecording dissolveRecording;
+DissolvePlayback dissolvePlayback[N];
+int recorder = -1;
+bool baked_playback = true;
+int record_interval = 4;
+float max_record_time = 30.0f;
+// Physics counters of the last frame, logged to physics_stats.csv while stats_log is open
+PhysicsStats physicsStats;
+std::ofstream stats_log;
+int stats_frame = 0;
 
 void createContext() {
     shaderProgram = loadShaders(
@@ -86,11 +117,14 @@ void createContext() {
     projectionMatrixLocation = glGetUniformLocation(shaderProgram, "P");
     viewMatrixLocation = glGetUniformLocation(shaderProgram, "V");
     modelMatrixLocation = glGetUniformLocation(shaderProgram, "M");
+    instancedLocation = glGetUniformLocation(shaderProgram, "instanced");
 
     // Debug console messages
     if (DEBUG_MESSAGES) {
         cout << "\n************ Runtime debug messages ************" << endl;
-        cout << "Available threads: " << omp_get_max_threads() << "\n" << endl;
+        cout << "Available threads: " << omp_get_max_threads() << endl;
+        cout << "Sphere integration kernel: " << sphereKernelName(selectSphereKernel()) << endl;
+        cout << endl;
     }
 
     // Add human models
@@ -103,25 +137,54 @@ void createContext() {
 #endif
 
     /**
-     * Create the bounding boxes of the model, between manually selected y-levels.
-     * These levels are shown in the createLimitsArray function in SphereFit.cpp
-     * Each bbox also holds the vertices that it contains in a class data member
+     * The limits of the bounding boxes (between manually selected y-levels,
+     * see createLimitsArray in SphereFit.cpp), the vertices each one holds,
+     * the billboard map, the fitted spheres and the voxel grid and distance
+     * field of the body depend only on the mesh and the parameters below.
+     * They are read from the cache, or computed (as thanos_bake does) and
+     * written to it.
      */
-    createLimitsArray();
-    if (DEBUG_MESSAGES)
-        cout << "Vertices inside each bounding box: "<< endl;
+    // Parameters (cubeSide: the real cube side will be cubeSide/100.0f)
+    FitParameters params;
+    params.bboardSize = bboard_size;
+    params.adaptive = adaptive_packing;
+    params.sphereBudget = sphere_budget;
+    float mass = 0.3f;
+
+    // The spheres bounce off the undissolved body, all the models share its hierarchy
+    double start3 = omp_get_wtime();
+    bodyBVH = new MeshBVH();
+    bodyBVH->build(models[0]->vertices);
+    FitData fit;
+    unsigned long long meshHash = hashMesh(models[0]->vertices);
+    bool cached = loadFitCache(fit_cache, meshHash, params, fit);
+    if (!cached) {
+        bakeFitData(models[0]->vertices, params, fit);
+        if (!saveFitCache(fit_cache, meshHash, params, fit))
+            cout << "Could not write the fit cache " << fit_cache << endl;
+    }
+    memcpy(limits, fit.limits, sizeof(limits));
+    billboardMap = fit.billboardMap;
+    b_levels = fit.levels;
+    bodyVoxels = fit.voxels;
+    bodySDF = fit.field;
+    double end3 = omp_get_wtime();
+    if (DEBUG_MESSAGES) {
+        cout << "\nFit data " << (cached ? "read from " : "computed and written to ") << fit_cache
+            << " in " << end3 - start3 << " seconds" << endl;
+        cout << "Vertices inside each bounding box: " << endl;
+        for (int i = 0; i < 5; i++)
+            cout << i << ": " << fit.slabVertices[i].size() << endl;
+    }
     for (int n = 0; n < N; n++) {
         for (int i = 0; i < 5; i++) {
             bbox[n][i] = new BoundingBox(limits[i]);
-            if (n == 0) bbox[n][i]->fillVertices(models[0]->vertices);
-            else bbox[n][i]->vertices = bbox[0][i]->vertices;
-            if (DEBUG_MESSAGES && n == 0)
-                cout << i << ": " << bbox[n][i]->vertices.size() << endl;
+            bbox[n][i]->vertices = fit.slabVertices[i];
         }
     }
+
 #ifdef DISPERSION
     // Create Billboards for the dispersion effect
-    createBillboardMap(bboard_size);
     double start1 = omp_get_wtime();
     for(int i = 0; i < N; i++)
         bboard_generator[i] = new BillboardGenerator(bbox[i], billboardMap, bboard_size);
@@ -132,23 +195,17 @@ void createContext() {
 #endif
 
 #ifdef SPHERES
-    /**
-     * Fit and create the spheres inside the human with the parameters given.
-     * The parameter cube_side is the step used in the createSpheres function.
-     */
-    // Parameters
-    int cube_side = 15;     // The real cube side will be cube_side/100.0f
-    float rad[] = { 0.03f, 0.02f, 0.015f };
-    float mass = 0.3f;
-
-    double start2 = omp_get_wtime();
-    createSpheres(cube_side, rad, mass);
-    double end2 = omp_get_wtime();
-
-    if (DEBUG_MESSAGES) {
-        cout << "\nSphere fitting and creation took " << end2 - start2 << " seconds" << endl;
-        cout << "Spheres inside the model:\n" << spheres[0].size() << endl;
+    // All the spheres share one mesh and are drawn instanced
+    sphereMesh = new Drawable("models/sphere.obj");
+    for (int n = 0; n < N; n++) {
+        spheres[n] = new SphereSystem();
+        spheres[n]->body = bodyBVH;
+        spheres[n]->adaptive = adaptive_steps;
     }
+    addSpheres(fit.spheres, mass);
+
+    if (DEBUG_MESSAGES)
+        cout << "Spheres inside the model:\n" << spheres[0]->size() << endl;
 #endif
 }
 
@@ -163,8 +220,7 @@ void moveModels(vec3* positions, mat4* matrices) {
         vec3 dir = normalize(camera->position - positions[i]);
         positions[i] += dir * model_speed;
         matrices[i] = translate(mat4(), positions[i]);
-        for (int j = 0; j < spheres[i].size(); j++)
-            spheres[i][j]->x += dir * model_speed;
+        spheres[i]->translate(dir * model_speed);
 
         for (int j = 0; j < bbox[i].size(); j++) {
             for (int k = 0; k < bbox[i][j]->BoxVertices.size(); k++) {
@@ -191,8 +247,9 @@ void free() {
         for (int i = 0; i < 5; i++)
             delete bbox[n][i];
     for (int i = 0; i < spheres.size(); i++)
-        for(int n = 0; n < spheres[i].size(); n++)
-            delete spheres[i][n];
+        delete spheres[i];
+    delete sphereMesh;
+    delete bodyBVH;
     glDeleteProgram(shaderProgram);
     glfwTerminate();
 }
@@ -203,7 +260,7 @@ void mainLoop() {
     // User starting position
     camera->position = glm::vec3(0, 1.5, 10);
     float t = 0;
-    float dt = 0;
+    FixedTimestep timestep(physics_step, max_substeps);
 
     // Models' starting positions
     vec3 modelPositions[] = {
@@ -221,10 +278,9 @@ void mainLoop() {
 #ifdef SPHERES
     // Put spheres into their right starting position
     for (int n = 0; n < N; n++) {
-        for (int i = 0; i < spheres[n].size(); i++) {
-            spheres[n][i]->x += modelPositions[n];
-            spheresStartingHeight[n][i] += modelPositions[n].y;
-        } 
+        spheres[n]->translate(modelPositions[n]);
+        for (int i = 0; i < spheres[n]->size(); i++)
+            spheres[n]->startingHeight[i] += modelPositions[n].y;
     }
 #endif
 
@@ -242,13 +298,52 @@ void mainLoop() {
         disp_level[i] = limits[0][3];
     
     do {
-        // Initialize simulation time
-        if (!clicked) t = glfwGetTime();
-        // Apply controlled simulation step (for slow PCs)
-        if (clicked) {
-            dt = glfwGetTime() - t;
-            if (dt > 0.004) dt = 0.004;
+        // The simulation starts with the first click, then advances in fixed steps
+        int steps = 0;
+        if (!clicked) timestep.reset(glfwGetTime());
+        else steps = timestep.advance(glfwGetTime());
+        physicsStats.reset();
+        physicsStats.steps = steps;
+        for (int s = 0; s < steps; s++) {
+            for (int n = 0; n < N; n++) {
+                if (dispersion[n] && !extinct[n] && disp_level[n] > limits[4][2])
+                    disp_level[n] -= disp_speed * timestep.step;
+            }
+#ifdef SPHERES
+            for (int n = 0; n < N; n++) {
+                if (!sim[n]) continue;
+                // The first dissolve is simulated and baked, the next ones play it back
+                if (dissolvePlayback[n].recording == NULL && spheres[n]->stepCount == 0) {
+                    startDissolve(n, modelPositions[n], timestep.step);
+                    spheres[n]->clock = t;
+                }
+                if (dissolvePlayback[n].recording != NULL) {
+                    PhaseTimer timer(physicsStats, PhysicsStats::PLAYBACK);
+                    dissolvePlayback[n].advance(timestep.step);
+                    continue;
+                }
+                // An adaptive system takes steps of its own size until its
+                // clock passes the end of this step, possibly none
+                do {
+                    if (spheres[n]->adaptive && spheres[n]->clock >= t + timestep.step) break;
+                    recordDissolve(n);
+                    spheres[n]->beginStep();
+                    spheres[n]->bodyOffset = modelPositions[n];
+                    spheres[n]->bodyLevel = disp_level[n];
+                    spheres[n]->release(disp_level[n] - limits[4][2]);
+                    spheres[n]->collide();
+                    spheres[n]->integrate(t, spheres[n]->adaptive ? spheres[n]->adaptiveStep : timestep.step);
+                    spheres[n]->updateSleeping();
+                    spheres[n]->sortSpatially();
+                    physicsStats.add(spheres[n]->stats);
+                } while (spheres[n]->adaptive);
+            }
+            removeSpheres();
+#endif
+            t += timestep.step;
         }
+        if (stats_log.is_open() && steps > 0) physicsStats.writeCSV(stats_log, stats_frame);
+        stats_frame++;
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glUseProgram(shaderProgram);
@@ -276,8 +371,7 @@ void mainLoop() {
                 glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
             }
             else if (!extinct[n]) {
-                if (disp_level[n] > limits[4][2]) disp_level[n] -= disp_speed * dt;
-                else {
+                if (disp_level[n] <= limits[4][2]) {
                     extinct[n] = true;
                     continue;
                 }
@@ -317,37 +411,30 @@ void mainLoop() {
 #endif
 
 #ifdef SPHERES
-        // Draw the spheres if the human is in wireframe mode or the simulation has started
+        // Draw the spheres if the simulation has started, interpolated between
+        // the last two steps, or draw all of them if the human is in wireframe mode
+        mat4 viewProjection = projectionMatrix * viewMatrix;
         for (int n = 0; n < N; n++) {
-            if (sim[n]) {
-                for (int i = 0; i < spheres[n].size(); i++) {
-                    if (spheresStartingHeight[n][i] - spheres[n][i]->r < disp_level[n] - limits[4][2]) continue;
-                    handleFloorSphereCollision(*spheres[n][i]);
-                    for (int j = 0; j < spheres[n].size(); j++) {
-                        if (i == j) continue;
-                        handleSpheresCollision(*spheres[n][i], *spheres[n][j]);
-                    }
-                    spheres[n][i]->forcing = [&](float t, const vector<float>& y)->vector<float> {
-                        vector<float> f(6, 0.0f);
-                        f[1] = -(spheres[n][i]->m * g_earth);
-                        return f;
-                    };
-                    spheres[n][i]->update(t, dt);
-                    glUniform1i(glGetUniformLocation(shaderProgram, "balls"), 1);
-                    glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &spheres[n][i]->modelMatrix[0][0]);
-                    spheres[n][i]->draw();
-                }
+            if (sim[n] && dissolvePlayback[n].recording != NULL) {
+                dissolvePlayback[n].writeInstanceMatrices(modelPositions[n], timestep.alpha() * timestep.step,
+                                                          viewProjection, spheres[n]->instanceMatrices);
+            }
+            else if (sim[n]) {
+                spheres[n]->cull(viewProjection);
+                spheres[n]->scheduleTiers(viewProjection, projectionMatrix[1][1] * W_HEIGHT / 2);
+                float time = t + timestep.alpha() * timestep.step;
+                spheres[n]->writeInstanceMatrices(spheres[n]->adaptive ? spheres[n]->interpolation(time) : timestep.alpha());
             }
             else if (wireframe) {
-                for (int i = 0; i < spheres[n].size(); i++) {
-                    spheres[n][i]->update();
-                    glUniform1i(glGetUniformLocation(shaderProgram, "balls"), 1);
-                    glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &spheres[n][i]->modelMatrix[0][0]);
-                    spheres[n][i]->draw();
-                }
+                spheres[n]->cull(viewProjection, false);
+                spheres[n]->writeInstanceMatrices();
             }
+            else continue;
+            glUniform1i(glGetUniformLocation(shaderProgram, "balls"), 1);
+            glUniform1i(instancedLocation, 1);
+            spheres[n]->draw(sphereMesh);
+            glUniform1i(instancedLocation, 0);
         }
-        removeSpheres();
 #endif
 
 #ifdef GLOVE
@@ -365,7 +452,6 @@ void mainLoop() {
         thanos->draw();
 #endif
 
-        t += dt;
         glfwSwapBuffers(window);
         glfwPollEvents();
 
@@ -379,6 +465,51 @@ void pollKeyboard(GLFWwindow* window, int key, int scancode, int action, int mod
     if (key == GLFW_KEY_T && action == GLFW_PRESS) {
         wireframe = !wireframe;
     }
+
+    // I key cycles through the sphere integrators
+    if (key == GLFW_KEY_I && action == GLFW_PRESS) {
+        integrator = (Integrator)((integrator + 1) % INTEGRATORS);
+        for (int n = 0; n < N; n++)
+            spheres[n]->setIntegrator(integrator);
+        if (DEBUG_MESSAGES)
+            cout << "Sphere integrator: " << integratorName(integrator) << endl;
+    }
+
+    // H key switches the sphere systems between fixed and adaptive steps
+    if (key == GLFW_KEY_H && action == GLFW_PRESS) {
+        adaptive_steps = !adaptive_steps;
+        for (int n = 0; n < N; n++)
+            spheres[n]->adaptive = adaptive_steps;
+        if (DEBUG_MESSAGES)
+            cout << "Adaptive sphere steps: " << (adaptive_steps ? "on" : "off") << endl;
+    }
+
+    // B key switches between playing the baked dissolve and simulating every dissolve live
+    if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+        baked_playback = !baked_playback;
+        if (DEBUG_MESSAGES)
+            cout << "Baked dissolve playback: " << (baked_playback ? "on" : "off") << endl;
+    }
+
+    // P key starts and stops logging the physics stats of every frame to physics_stats.csv
+    if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+        if (stats_log.is_open()) stats_log.close();
+        else {
+            stats_log.open("physics_stats.csv");
+            PhysicsStats::writeCSVHeader(stats_log);
+        }
+        if (DEBUG_MESSAGES)
+            cout << "Physics stats log: " << (stats_log.is_open() ? "on" : "off") << endl;
+    }
+
+    // X key switches between the impulse and the XPBD contact solver
+    if (key == GLFW_KEY_X && action == GLFW_PRESS) {
+        solver = solver == IMPULSE_SOLVER ? XPBD_SOLVER : IMPULSE_SOLVER;
+        for (int n = 0; n < N; n++)
+            spheres[n]->solver = solver;
+        if (DEBUG_MESSAGES)
+            cout << "Contact solver: " << (solver == XPBD_SOLVER ? "XPBD" : "impulse") << endl;
+    }
 }
 
 void pollMouse(GLFWwindow* window, int button, int action, int mods) {